@@ -1,4 +1,8 @@
 #include "ast.hpp"
+#include "stats.hpp"
+#include "memreport.hpp"
+#include "debuginfo.hpp"
+#include "stream.hpp"
 //TODO lifespan of vars not working
 void yyerror(string s);
 
@@ -8,32 +12,208 @@ Module* TheModule;
 std::vector<std::map<std::string, AllocaInst*>> NamedValuesVec;
 map<string, AllocaInst*> NamedValues;
 legacy::FunctionPassManager* TheFPM;
+//indices into NamedValuesVec of the scopes that declare something, so a
+//lookup from deep inside nested blocks skips the empty ones between
+static vector<unsigned> DeclScopes;
+
+//scopes are moved, not copied, on the way in and out
+static void PushScope() {
+    if (!NamedValues.empty())
+        DeclScopes.push_back(NamedValuesVec.size());
+    NamedValuesVec.push_back(std::move(NamedValues));
+    NamedValues.clear();
+}
+
+static void PopScope() {
+    NamedValues = std::move(NamedValuesVec.back());
+    NamedValuesVec.pop_back();
+    if (!DeclScopes.empty() && DeclScopes.back() == NamedValuesVec.size())
+        DeclScopes.pop_back();
+}
+
+//frames stay allocated between functions, so their vectors keep capacity
+static vector<CodegenFrame> Frames;
+static size_t Depth = 0;
+
+static void PushFrame(const ExprAST *e) {
+    if (Depth == Frames.size())
+        Frames.emplace_back();
+    CodegenFrame &F = Frames[Depth++];
+    F.Node = e;
+    F.Step = 0;
+    F.Next = nullptr;
+    F.Child = F.Result = F.Val = nullptr;
+    F.Index = 0;
+    F.Count = 0;
+    F.Vals.clear();
+    F.BBs.clear();
+}
+
+//the tree is walked from Frames instead of the C++ stack, so nesting
+//depth and expression length are bounded by the heap
+Value* ExprAST::codegen() const {
+    size_t Base = Depth;
+    PushFrame(this);
+    for (;;) {
+        CodegenFrame &F = Frames[Depth - 1];
+        if (TheDebugInfo)
+            TheDebugInfo->setLocation(F.Node);
+        if (!F.Node->codegenStep(F)) {
+            PushFrame(F.Next);
+            continue;
+        }
+        Value *V = F.Result;
+        Depth--;
+        if (Depth == Base)
+            return V;
+        if (V == nullptr) {
+            //a node that failed fails every node above it
+            while (Depth > Base)
+                Frames[--Depth].Node->codegenFailed();
+            return nullptr;
+        }
+        Frames[Depth - 1].Child = V;
+    }
+}
 
-Value* IntNumberExprAST::codegen() const {
-  	return ConstantInt::get(TheContext, APInt(32, Val));
+bool IntNumberExprAST::codegenStep(CodegenFrame &F) const {
+  	return F.done(ConstantInt::get(TheContext, APInt(32, Val)));
 }
 
-Value* DoubleNumberExprAST::codegen() const {
-  	return ConstantFP::get(TheContext, APFloat(Val));
+bool DoubleNumberExprAST::codegenStep(CodegenFrame &F) const {
+  	return F.done(ConstantFP::get(TheContext, APFloat(Val)));
 }
 
-Value* VariableExprAST::codegen() const {
+bool VariableExprAST::codegenStep(CodegenFrame &F) const {
 	AllocaInst* tmp = FindVarInTable(Name);
 	if (tmp == nullptr)
 		yyerror("Variable " + Name + " does not exist!");
-	return Builder.CreateLoad(tmp, Name);
+	return F.done(Builder.CreateLoad(tmp, Name));
 }
 
 //destructors
 
 TypeAST::~TypeAST() {}
 
+//each node gives its children up before it is deleted, so no destructor
+//recurses however deep the tree is
+static void DeleteTrees(vector<ExprAST*> &work) {
+    while (!work.empty()) {
+        ExprAST *e = work.back();
+        work.pop_back();
+        e->releaseChildren(work);
+        delete e;
+    }
+}
+
 InnerExprAST::~InnerExprAST() {
-  	for (auto i : Vec)
-    	delete i;
+    vector<ExprAST*> work;
+    InnerExprAST::releaseChildren(work);
+    DeleteTrees(work);
+}
+
+FunctionAST::~FunctionAST() {
+    delete Proto;
+    vector<ExprAST*> work;
+    if (Body != nullptr)
+        work.push_back(Body);
+    DeleteTrees(work);
+}
+
+PrototypeAST::~PrototypeAST() {
+    for (auto a : Args)
+        delete a;
+}
+
+SwitchExprAST::~SwitchExprAST() {
+    vector<ExprAST*> work;
+    SwitchExprAST::releaseChildren(work);
+    DeleteTrees(work);
+}
+
+DeclAndAssignExprAST::~DeclAndAssignExprAST() {
+    vector<ExprAST*> work;
+    DeclAndAssignExprAST::releaseChildren(work);
+    DeleteTrees(work);
+}
+
+//bytes owned besides the children, --mem-report
+
+void InnerExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Buffers += MemReport::vectorBytes(Vec);
+}
+
+void VariableExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Strings += MemReport::stringBytes(Name);
+}
+
+void CallExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    InnerExprAST::ownedBytes(Buffers, Strings);
+    Strings += MemReport::stringBytes(Callee);
+}
+
+void AssignExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    InnerExprAST::ownedBytes(Buffers, Strings);
+    Strings += MemReport::stringBytes(VarName);
+}
+
+void DeclAndAssignExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Strings += MemReport::stringBytes(VarName);
+}
+
+void DeclExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Buffers += MemReport::vectorBytes(Vec);
+    for (auto &v : Vec)
+        Strings += MemReport::stringBytes(v);
+}
+
+void SwitchExprAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Buffers += MemReport::vectorBytes(Cases);
+}
+
+void PrototypeAST::ownedBytes(size_t &Buffers, size_t &Strings) const {
+    Buffers += MemReport::vectorBytes(Args);
+    Strings += MemReport::stringBytes(Name);
+    for (auto a : Args) {
+        Buffers += MemReport::heapBytes(a);
+        Strings += MemReport::stringBytes(a->VarName);
+    }
+}
+
+void InnerExprAST::children(vector<const ExprAST*> &out) const {
+    for (auto i : Vec)
+        if (i != nullptr)
+            out.push_back(i);
+}
+
+void SwitchExprAST::children(vector<const ExprAST*> &out) const {
+    out.push_back(Condition);
+    for (auto &c : Cases) {
+        if (c.first.first != nullptr)
+            out.push_back(c.first.first);
+        out.push_back(c.first.second);
+    }
+}
+
+void InnerExprAST::releaseChildren(vector<ExprAST*> &out) {
+    for (auto i : Vec)
+        if (i != nullptr)
+            out.push_back(i);
+    Vec.clear();
 }
 
-FunctionAST::~FunctionAST() { delete Body; }
+void SwitchExprAST::releaseChildren(vector<ExprAST*> &out) {
+    if (Condition != nullptr)
+        out.push_back(Condition);
+    for (auto &c : Cases) {
+        if (c.first.first != nullptr)
+            out.push_back(c.first.first);
+        if (c.first.second != nullptr)
+            out.push_back(c.first.second);
+    }
+    Condition = nullptr;
+    Cases.clear();
+}
 
 InnerExprAST::InnerExprAST(ExprAST *e1) {
  	Vec.push_back(e1);
@@ -57,28 +237,43 @@ InnerExprAST::InnerExprAST(ExprAST *e1, ExprAST *e2, ExprAST *e3, ExprAST *e4) {
 	Vec.push_back(e4);
 }
 
-Value *BlockAST::codegen() const {
-    
-    NamedValuesVec.push_back(NamedValues);
-    NamedValues.clear();
+bool BlockAST::codegenStep(CodegenFrame &F) const {
     
-    Value *tmp = nullptr;
-    for(auto i: Vec){
-        tmp = i->codegen();
-        if(tmp == nullptr)
-            yyerror("Codegen err");
+    if (F.Step == 0) {
+        PushScope();
+        if (TheDebugInfo)
+            TheDebugInfo->pushBlock(this);
     }
     
-    NamedValues = NamedValuesVec.back();
-    NamedValuesVec.pop_back();
-    return tmp;
+    //the value of the block is the value of its last statement
+    if (F.Index < Vec.size())
+        return F.call(Vec[F.Index++], 1);
+    
+    if (TheMemReport.Enabled)
+        TheMemReport.symbolTables(NamedValues, NamedValuesVec);
+    PopScope();
+    if (TheDebugInfo)
+        TheDebugInfo->popBlock(this);
+    return F.done(F.Child);
 }
 
-Value* AddExprAST::codegen() const {
-	Value *l = Vec[0]->codegen();
-	Value *r = Vec[1]->codegen();
-    if (!l || !r)
-		return nullptr;
+void BlockAST::codegenFailed() const {
+    yyerror("Codegen err");
+}
+
+bool BinaryExprAST::codegenStep(CodegenFrame &F) const {
+    switch (F.Step) {
+    case 0:
+        return F.call(Vec[0], 1);
+    case 1:
+        F.Val = F.Child;
+        return F.call(Vec[1], 2);
+    default:
+        return F.done(build(F.Val, F.Child));
+    }
+}
+
+Value* AddExprAST::build(Value *l, Value *r) const {
     
     Type* typel = l->getType();
     Type* typer = r->getType();
@@ -94,11 +289,7 @@ Value* AddExprAST::codegen() const {
     }
 }
 
-Value* SubExprAST::codegen() const {
-	Value *l = Vec[0]->codegen();
-	Value *r = Vec[1]->codegen();
-	if (!l || !r)
-		return nullptr;
+Value* SubExprAST::build(Value *l, Value *r) const {
     
     Type* typel = l->getType();
     Type* typer = r->getType();
@@ -114,11 +305,7 @@ Value* SubExprAST::codegen() const {
     }
 }
 
-Value* MulExprAST::codegen() const {
-	Value *l = Vec[0]->codegen();
-	Value *r = Vec[1]->codegen();
-	if (!l || !r)
-		return nullptr;
+Value* MulExprAST::build(Value *l, Value *r) const {
     
     Type* typel = l->getType();
     Type* typer = r->getType();
@@ -134,11 +321,7 @@ Value* MulExprAST::codegen() const {
     }
 }
 
-Value* DivExprAST::codegen() const {
-	Value *l = Vec[0]->codegen();
-	Value *r = Vec[1]->codegen();
-	if (!l || !r)
-		return nullptr;
+Value* DivExprAST::build(Value *l, Value *r) const {
     
     Type* typel = l->getType();
     Type* typer = r->getType();
@@ -155,11 +338,7 @@ Value* DivExprAST::codegen() const {
     }
 }
 
-Value* LtExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* LtExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -179,11 +358,7 @@ Value* LtExprAST::codegen() const {
     
 }
 
-Value* GtExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* GtExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -203,11 +378,7 @@ Value* GtExprAST::codegen() const {
     
 }
 
-Value* EqExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* EqExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -227,11 +398,7 @@ Value* EqExprAST::codegen() const {
     
 }
 
-Value* NeExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* NeExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -251,11 +418,7 @@ Value* NeExprAST::codegen() const {
     
 }
 
-Value* LeExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* LeExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -275,11 +438,7 @@ Value* LeExprAST::codegen() const {
     
 }
 
-Value* GeExprAST::codegen() const {
-    Value *l = Vec[0]->codegen();
-    Value *r = Vec[1]->codegen();
-    if (!l || !r)
-      return nullptr;
+Value* GeExprAST::build(Value *l, Value *r) const {
     Type* typel = l->getType();
     Type* typer = r->getType();
     if (typel != typer)
@@ -300,10 +459,10 @@ Value* GeExprAST::codegen() const {
 }
 
 
-Value* AssignExprAST::codegen() const {
-	Value *Val = Vec[0]->codegen();
-	if (Val == nullptr)
-		return nullptr;
+bool AssignExprAST::codegenStep(CodegenFrame &F) const {
+	if (F.Step == 0)
+		return F.call(Vec[0], 1);
+	Value *Val = F.Child;
 
 	AllocaInst* alloca = FindVarInTable(VarName);
 	if (alloca == nullptr)
@@ -316,10 +475,13 @@ Value* AssignExprAST::codegen() const {
     
 	Builder.CreateStore(Val, alloca);
 	
-	return Val;
+	return F.done(Val);
 }
 
-Value* DeclAndAssignExprAST::codegen() const {
+bool DeclAndAssignExprAST::codegenStep(CodegenFrame &F) const {
+    
+    if (F.Step == 1)
+        return assign(F.Child, F);
     
     Function *TheFunction = Builder.GetInsertBlock()->getParent();
     
@@ -336,15 +498,15 @@ Value* DeclAndAssignExprAST::codegen() const {
     if (VarType == Type::getInt32Ty(TheContext))
 		tmp = ConstantInt::get(TheContext, APInt(32, 0));
     if (tmp == nullptr)
-		return nullptr;
+		return F.done(nullptr);
 		
     NamedValues[VarName] = Alloca;
     Builder.CreateStore(tmp, Alloca);
 	
-	Value *Val = Expr->codegen();
-	if (Val == nullptr)
-		return nullptr;
+	return F.call(Expr, 1);
+}
 
+bool DeclAndAssignExprAST::assign(Value *Val, CodegenFrame &F) const {
 	AllocaInst* alloca = FindVarInTable(VarName);
 	if (alloca == nullptr)
 		yyerror("Variable " + VarName + " does not exist");
@@ -356,31 +518,35 @@ Value* DeclAndAssignExprAST::codegen() const {
     
 	Builder.CreateStore(Val, alloca);
 	
-	return Val;
+	return F.done(Val);
     
 }
 
-Value* CallExprAST::codegen() const {
-  Function* CalleeF = TheModule->getFunction(Callee);
-  if (CalleeF == nullptr)
-    yyerror("Function " + Callee + " does not exist");
-
-  unsigned arg_size = CalleeF->arg_size();
-  if (arg_size != Vec.size())
-    yyerror("Function " + Callee + " must be called with " + to_string(arg_size) + " arguments");
-
-  vector<Value*> args;
-  for (unsigned i = 0; i < arg_size; i++) {
-    Value *tmp = Vec[i]->codegen();
-    if (tmp == nullptr)
-      return nullptr;
-    args.push_back(tmp);
+bool CallExprAST::codegenStep(CodegenFrame &F) const {
+  if (F.Step == 0) {
+    Function* CalleeF = TheModule->getFunction(Callee);
+    //--stream keeps printed functions out of the module
+    if (CalleeF == nullptr && TheStreamer)
+      CalleeF = TheStreamer->declaration(Callee);
+    if (CalleeF == nullptr)
+      yyerror("Function " + Callee + " does not exist");
+
+    unsigned arg_size = CalleeF->arg_size();
+    if (arg_size != Vec.size())
+      yyerror("Function " + Callee + " must be called with " + to_string(arg_size) + " arguments");
+    F.Val = CalleeF;
+  }
+  else {
+    F.Vals.push_back(F.Child);
   }
 
-  return Builder.CreateCall(CalleeF, args, "calltmp");
+  //arguments left to right, then the call
+  if (F.Vals.size() < Vec.size())
+    return F.call(Vec[F.Vals.size()], 1);
+  return F.done(Builder.CreateCall(cast<Function>(F.Val), F.Vals, "calltmp"));
 }
 
-Value *DeclExprAST::codegen() const {
+bool DeclExprAST::codegenStep(CodegenFrame &F) const {
 	Function *TheFunction = Builder.GetInsertBlock()->getParent();
     
 	Value *tmp;
@@ -397,19 +563,21 @@ Value *DeclExprAST::codegen() const {
 		if (Types == Type::getInt32Ty(TheContext))
 		tmp = ConstantInt::get(TheContext, APInt(32, 0));
 		if (tmp == nullptr)
-		return nullptr;
+		return F.done(nullptr);
 		
 		NamedValues[Vec[i]] = Alloca;
 		Builder.CreateStore(tmp, Alloca);
 	}
 
-	return tmp;
+	return F.done(tmp);
 }
 
-Value* IfExprAST::codegen() const {
-    Value* CondV = Vec[0]->codegen();
-    if (CondV == nullptr)
-      return nullptr;
+bool IfExprAST::codegenStep(CodegenFrame &F) const {
+    switch (F.Step) {
+    case 0:
+        return F.call(Vec[0], 1);
+    case 1: {
+    Value* CondV = F.Child;
     
     Value* IfCondV;
     Type * CondType = CondV->getType();
@@ -420,69 +588,122 @@ Value* IfExprAST::codegen() const {
 
     Function* TheFunction = Builder.GetInsertBlock()->getParent();
     BasicBlock* ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-    BasicBlock* ElseBB = BasicBlock::Create(TheContext, "else");
-    BasicBlock* MergeBB = BasicBlock::Create(TheContext, "ifcont");
+    BasicBlock* ElseBB = F.BB[0] = BasicBlock::Create(TheContext, "else");
+    F.BB[1] = BasicBlock::Create(TheContext, "ifcont");
     
     Builder.CreateCondBr(IfCondV, ThenBB, ElseBB);
 
     Builder.SetInsertPoint(ThenBB);
-    Value* ThenV = Vec[1]->codegen();
-    if (ThenV == nullptr)
-    	return nullptr;
-    Builder.CreateBr(MergeBB);
-    ThenBB = Builder.GetInsertBlock();
+    return F.call(Vec[1], 2);
+    }
+    case 2: {
+    BasicBlock* ElseBB = F.BB[0];
+    Builder.CreateBr(F.BB[1]);
     
+    Function* TheFunction = Builder.GetInsertBlock()->getParent();
     TheFunction->getBasicBlockList().push_back(ElseBB);
     Builder.SetInsertPoint(ElseBB);
     
-    if(Vec[2] != nullptr){
-        Value* ElseV = Vec[2]->codegen();
-        if (ElseV == nullptr)
-            return nullptr;
+    if(Vec[2] != nullptr)
+        return F.call(Vec[2], 3);
     }
-    
+    //no else, falls through
+    LLVM_FALLTHROUGH;
+    default: {
+    BasicBlock* MergeBB = F.BB[1];
     Builder.CreateBr(MergeBB);
-    ElseBB = Builder.GetInsertBlock();
 
+    Function* TheFunction = Builder.GetInsertBlock()->getParent();
     TheFunction->getBasicBlockList().push_back(MergeBB);
     Builder.SetInsertPoint(MergeBB);
     
-    return ConstantInt::get(TheContext, APInt(32, 0));
+    return F.done(ConstantInt::get(TheContext, APInt(32, 0)));
+    }
+    }
 
 }
 
-Value* WhileExprAST::codegen() const {
-
-    Function *F = Builder.GetInsertBlock()->getParent();
-    BasicBlock *Loop1BB = BasicBlock::Create(TheContext, "loop1", F);
-    BasicBlock *Loop2BB = BasicBlock::Create(TheContext, "loop2", F);
-    BasicBlock *AfterLoopBB = BasicBlock::Create(TheContext, "afterloop", F);
-    Builder.CreateBr(Loop1BB);
-    Builder.SetInsertPoint(Loop1BB);
-    
-    Value* CondV = Vec[0]->codegen();
-    if (CondV == nullptr)
-      return nullptr;
-    
-    Value* WhileCondV;
+//loops take the body while the condition holds, same test as the baseline while
+static Value *LoopCondition(Value *CondV) {
     Type * CondType = CondV->getType();
     if(CondType == Type::getDoubleTy(TheContext))
-        WhileCondV = Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "whilecond");
-    else if(CondType == Type::getInt32Ty(TheContext))
-        WhileCondV = Builder.CreateICmpEQ(CondV, ConstantInt::get(TheContext, APInt(32, 0)), "whilecond");
-    
-    Builder.CreateCondBr(WhileCondV, Loop2BB, AfterLoopBB);
-    Loop1BB = Builder.GetInsertBlock();
+        return Builder.CreateFCmpONE(CondV, ConstantFP::get(TheContext, APFloat(0.0)), "whilecond");
+    if(CondType == Type::getInt32Ty(TheContext))
+        return Builder.CreateICmpEQ(CondV, ConstantInt::get(TheContext, APInt(32, 0)), "whilecond");
+    yyerror("Loop condition must be int or double!");
+    return nullptr;
+}
 
-    Builder.SetInsertPoint(Loop2BB);
-    Value* Tmp = Vec[1]->codegen();
-    if (Tmp == nullptr)
-        return nullptr;
-    Builder.CreateBr(Loop1BB);
-    Loop2BB = Builder.GetInsertBlock();
+//canonical loop shape for the loop passes: a preheader holding Init, a
+//header testing Cond, the body, and a single latch running Step whose
+//back edge carries the loop id. F.BB holds header, body, latch and exit
+static bool LoopStep(CodegenFrame &F, const ExprAST *Init, const ExprAST *Cond, const ExprAST *Step, const ExprAST *Body) {
+    Function *Fn = Builder.GetInsertBlock()->getParent();
+    switch (F.Step) {
+    case 0: {
+        BasicBlock *PreheaderBB = BasicBlock::Create(TheContext, "preheader", Fn);
+        F.BB[0] = BasicBlock::Create(TheContext, "loop1", Fn);
+        F.BB[1] = BasicBlock::Create(TheContext, "loop2", Fn);
+        F.BB[2] = BasicBlock::Create(TheContext, "latch");
+        F.BB[3] = BasicBlock::Create(TheContext, "afterloop");
+        Builder.CreateBr(PreheaderBB);
+        Builder.SetInsertPoint(PreheaderBB);
+        if (Init != nullptr)
+            return F.call(Init, 1);
+    }
+    //no init, falls through
+    LLVM_FALLTHROUGH;
+    case 1:
+        Builder.CreateBr(F.BB[0]);
+        Builder.SetInsertPoint(F.BB[0]);
+        if (Cond != nullptr)
+            return F.call(Cond, 2);
+        Builder.CreateBr(F.BB[1]);
+        Builder.SetInsertPoint(F.BB[1]);
+        return F.call(Body, 3);
+    case 2:
+        Builder.CreateCondBr(LoopCondition(F.Child), F.BB[1], F.BB[3]);
+        Builder.SetInsertPoint(F.BB[1]);
+        return F.call(Body, 3);
+    case 3:
+        Builder.CreateBr(F.BB[2]);
+        Fn->getBasicBlockList().push_back(F.BB[2]);
+        Builder.SetInsertPoint(F.BB[2]);
+        if (Step != nullptr)
+            return F.call(Step, 4);
+    }
+    //no step, falls through
+    BranchInst *BackEdge = Builder.CreateBr(F.BB[0]);
+    //with -g the loop's position follows, for the passes' remarks
+    SmallVector<Metadata*, 2> LoopOps(1, nullptr);
+    if (DILocation *Loc = Builder.getCurrentDebugLocation())
+        LoopOps.push_back(Loc);
+    MDNode *LoopID = MDNode::getDistinct(TheContext, LoopOps);
+    LoopID->replaceOperandWith(0, LoopID);
+    BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
+
+    Fn->getBasicBlockList().push_back(F.BB[3]);
+    Builder.SetInsertPoint(F.BB[3]);
+    return F.done(ConstantInt::get(TheContext, APInt(32, 0)));
+}
+
+bool WhileExprAST::codegenStep(CodegenFrame &F) const {
+    return LoopStep(F, nullptr, Vec[0], nullptr, Vec[1]);
+}
 
-    Builder.SetInsertPoint(AfterLoopBB);
-    return ConstantInt::get(TheContext, APInt(32, 0));
+bool ForExprAST::codegenStep(CodegenFrame &F) const {
+    //a declaration in the init is visible in the loop only
+    if (F.Step == 0) {
+        PushScope();
+        if (TheDebugInfo)
+            TheDebugInfo->pushBlock(this);
+    }
+    if (!LoopStep(F, Vec[0], Vec[1], Vec[2], Vec[3]))
+        return false;
+    PopScope();
+    if (TheDebugInfo)
+        TheDebugInfo->popBlock(this);
+    return true;
 }
 
 Function *PrototypeAST::codegen() const {
@@ -505,6 +726,9 @@ Function *PrototypeAST::codegen() const {
 }
 
 Function *FunctionAST::codegen() const {
+	//the previous function's scope goes first, so it is not charged to this one
+	NamedValues.clear();
+	size_t HeapStart = TheMemReport.Enabled ? MemReport::heapInUse() : 0;
 	Function* TheFunction = TheModule->getFunction(Proto->getName());
   	
 	if (TheFunction == nullptr)
@@ -516,10 +740,12 @@ Function *FunctionAST::codegen() const {
   	if (!TheFunction->empty())
     	yyerror("Function redefinition is not allowed " + Proto->getName());
 
+	double Start = TheStats.Enabled ? Stats::now() : 0;
 	BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
 	Builder.SetInsertPoint(BB);
+	if (TheDebugInfo)
+		TheDebugInfo->beginFunction(TheFunction, Proto, Body);
 
-	NamedValues.clear();
 	for (auto &Arg : TheFunction->args()) {
 		AllocaInst *Alloca =
 			CreateEntryBlockAlloca(Arg.getType(), TheFunction, Arg.getName());
@@ -534,112 +760,191 @@ Function *FunctionAST::codegen() const {
         }
         
         Builder.CreateRet(RetVal);
+		if (TheDebugInfo)
+			TheDebugInfo->endFunction();
+		double Built = TheStats.Enabled ? Stats::now() : 0;
 		verifyFunction(*TheFunction);
-		TheFPM->run(*TheFunction);
+		double Verified = TheStats.Enabled ? Stats::now() : 0;
+		if (TheFPM)
+			TheFPM->run(*TheFunction);
+		double Optimized = TheStats.Enabled ? Stats::now() : 0;
+		unsigned Insts = 0;
+		if (TheStats.Enabled || TheMemReport.Enabled)
+			for (auto &B : *TheFunction)
+				Insts += B.size();
+		if (TheMemReport.Enabled) {
+			size_t HeapEnd = MemReport::heapInUse();
+			TheMemReport.Functions.push_back({ Proto->getName(),
+				HeapEnd > HeapStart ? HeapEnd - HeapStart : 0, (unsigned)TheFunction->size(), Insts });
+		}
+		if (TheStats.Enabled) {
+			TheStats.Functions.push_back({ Proto->getName(), Built - Start, Verified - Built,
+				Optimized - Verified, (unsigned)TheFunction->size(), Insts });
+			TheStats.Phases["codegen"] += Built - Start;
+			TheStats.Phases["verify"] += Verified - Built;
+			TheStats.Phases["optimize"] += Optimized - Verified;
+		}
 		return TheFunction;
 	}
 	
+	if (TheDebugInfo)
+		TheDebugInfo->endFunction();
 	TheFunction->eraseFromParent();
 
 	return NULL;
 }
 
-Value* SwitchExprAST::codegen() const {
-    
-    //generating switch condition
-    Value* SwitchCond = Condition->codegen();
-    if (SwitchCond == nullptr)
-        return nullptr;
+bool SwitchExprAST::codegenStep(CodegenFrame &F) const {
     
+    //F.Val is the selector, F.BBs the case bodies and F.BB[0] the merge block
     Function* TheFunction = Builder.GetInsertBlock()->getParent();
     
+    switch (F.Step) {
+    case 0:
+        //generating switch condition
+        return F.call(Condition, 1);
+    case 1: {
+    F.Val = F.Child;
+    
     int num_of_default_cases = 0;
 
     //check if default case exists 
     for(int i = 0; i < Cases.size(); i++){
-        if(Cases[i].first.first == nullptr){
+        if(Cases[i].first.first == nullptr)
             num_of_default_cases++;
-            
-            
-            //************dangerous buisness****************
-            
-            //TODO DEFAULT CASE
-            
-            //**********************************************
-        }
     }
     
-    
     if(num_of_default_cases > 1)
         yyerror("Too much default cases! Only one allowed");
-    //calculate number of IF statemets
-    int num_of_ifs = Cases.size() - num_of_default_cases;
     
-    std::vector<BasicBlock*> ThenBBs(num_of_ifs);
-    std::vector<BasicBlock*> ElseBBs(num_of_ifs);
-    BasicBlock* MergeBB = BasicBlock::Create(TheContext, "ifcont");
-    
-    
-    //default is num_of_ifs
-    for(int i = 0; i < num_of_ifs; i++) {
-        
-        Value* CaseCond;
-        
-        //if current case is not default case
-        if(Cases[i].first.first != nullptr)
-            CaseCond = Cases[i].first.first->codegen();
-        
-        if(CaseCond == nullptr)
-            return nullptr;
-        
-        Value *IfCondV = Builder.CreateICmpEQ(SwitchCond, CaseCond, "ifcond");
-        
-        ThenBBs[i] = BasicBlock::Create(TheContext, "then", TheFunction);
-        ElseBBs[i] = BasicBlock::Create(TheContext, "else");
+    //one block per case body, in source order, so a case without break
+    //falls into the next body as in C
+    for(int i = 0; i < Cases.size(); i++)
+        F.BBs.push_back(BasicBlock::Create(TheContext, "then"));
+    F.BB[0] = BasicBlock::Create(TheContext, "ifcont");
+    F.Index = 0;
+    }
+    //on to the first label
+    LLVM_FALLTHROUGH;
+    case 2:
+    //if/else chain over the labels, in source order
+    if (F.Step == 2) {
         
-        Builder.CreateCondBr(IfCondV, ThenBBs[i], ElseBBs[i]);
-        Builder.SetInsertPoint(ThenBBs[i]);
-
-        Value* ThenV = Cases[i].first.second->codegen();
-        if(ThenV == nullptr)
-            return nullptr;
+        //the compare is on its case's line
+        if (TheDebugInfo)
+            TheDebugInfo->setLocation(Cases[F.Index].first.first);
+        Value *IfCondV = Builder.CreateICmpEQ(F.Val, F.Child, "ifcond");
+        F.Count += isa<ICmpInst>(IfCondV);
         
-        Value* BreakCond = ConstantInt::get(TheContext, APInt(32, 0));
-        //if case has break stmt jump to MergeBB which is the end
-        if(Cases[i].second){
-            BreakCond = ConstantInt::get(TheContext, APInt(32, 1));
+        BasicBlock* ElseBB = BasicBlock::Create(TheContext, "else", TheFunction);
+        Builder.CreateCondBr(IfCondV, F.BBs[F.Index++], ElseBB);
+        Builder.SetInsertPoint(ElseBB);
+    }
+    while (F.Index < Cases.size() && Cases[F.Index].first.first == nullptr)
+        F.Index++;
+    if (F.Index < Cases.size())
+        return F.call(Cases[F.Index].first.first, 2);
+    
+    {
+    //no label matched
+    BasicBlock *Miss = F.BB[0];
+    for(int i = 0; i < Cases.size(); i++)
+        if(Cases[i].first.first == nullptr) {
+            Miss = F.BBs[i];
+            if (TheDebugInfo)
+                TheDebugInfo->setLocation(Cases[i].first.second);
         }
-        
-        Value *IfBreakV = Builder.CreateICmpEQ(BreakCond, ConstantInt::get(TheContext, APInt(32, 0)), "ifbreak");
-        
-        Builder.CreateCondBr(IfBreakV, ElseBBs[i], MergeBB);
-        ThenBBs[i] = Builder.GetInsertBlock();
-        
-        TheFunction->getBasicBlockList().push_back(ElseBBs[i]);
-        Builder.SetInsertPoint(ElseBBs[i]);        
+    Builder.CreateBr(Miss);
+    F.Index = 0;
+    }
+    //on to the bodies
+    LLVM_FALLTHROUGH;
+    case 3:
+    if (F.Step == 3) {
+        //break or the last case leaves the switch, otherwise fall through
+        size_t i = F.Index++;
+        bool last = i + 1 == Cases.size();
+        if (TheDebugInfo)
+            TheDebugInfo->setLocation(Cases[i].first.second);
+        Builder.CreateBr(Cases[i].second || last ? F.BB[0] : F.BBs[i + 1]);
+    }
+    if (F.Index < Cases.size()) {
+        TheFunction->getBasicBlockList().push_back(F.BBs[F.Index]);
+        Builder.SetInsertPoint(F.BBs[F.Index]);
+        return F.call(Cases[F.Index].first.second, 3);
+    }
     }
-        
-    Builder.CreateBr(MergeBB);
-    ElseBBs[num_of_ifs-1] = Builder.GetInsertBlock();
     
-    TheFunction->getBasicBlockList().push_back(MergeBB);
-    Builder.SetInsertPoint(MergeBB);    
+    TheFunction->getBasicBlockList().push_back(F.BB[0]);
+    Builder.SetInsertPoint(F.BB[0]);    
+    
+    if (TheStats.Enabled) {
+        //a merge block, one per body and an else block per label
+        unsigned Labels = 0;
+        for (auto &c : Cases)
+            Labels += c.first.first != nullptr;
+        TheStats.Switches.push_back({ TheFunction->getName().str(), (unsigned)Cases.size(),
+            (unsigned)Cases.size() + 1 + Labels, F.Count });
+    }
     
-    return ConstantInt::get(TheContext, APInt(32, 0));
+    return F.done(ConstantInt::get(TheContext, APInt(32, 0)));
     
 }
 
-void TheFpmAndModuleInit(){
+//cost models for unrolling and vectorisation come from the host
+static TargetMachine *HostTargetMachine() {
+    InitializeNativeTarget();
+    string Triple = sys::getDefaultTargetTriple();
+    string Err;
+    const Target *T = TargetRegistry::lookupTarget(Triple, Err);
+    if (T == nullptr)
+        yyerror(Err);
+    return T->createTargetMachine(Triple, sys::getHostCPUName(), "", TargetOptions(),
+                                  Optional<Reloc::Model>());
+}
+
+void TheFpmAndModuleInit(int OptLevel){
     
     TheModule = new Module("swi2else", TheContext);
+    //-O0: functions are only verified, no passes run
+    if (OptLevel == 0) {
+        TheFPM = nullptr;
+        return;
+    }
     TheFPM = new legacy::FunctionPassManager(TheModule);
     
+    if (OptLevel >= 2) {
+        static TargetMachine *TM = HostTargetMachine();
+        TheModule->setTargetTriple(TM->getTargetTriple().str());
+        TheModule->setDataLayout(TM->createDataLayout());
+        TheFPM->add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+        TheFPM->add(createPromoteMemoryToRegisterPass());
+        TheFPM->add(createInstructionCombiningPass());
+        TheFPM->add(createEarlyCSEPass());
+    }
+    
     //TheFPM->add(createInstructionCombiningPass());
     TheFPM->add(createReassociatePass());
     //TheFPM->add(createNewGVNPass());
     //TheFPM->add(createCFGSimplificationPass());
     //TheFPM->add(createPromoteMemoryToRegisterPass());
     
+    //-O2 loop pipeline. No CFG simplification: it would fold the if/else
+    //chains this tool emits back into switches
+    if (OptLevel >= 2) {
+        TheFPM->add(createLoopSimplifyPass());
+        TheFPM->add(createLCSSAPass());
+        TheFPM->add(createLoopRotatePass());
+        TheFPM->add(createLICMPass());
+        //invariant selectors: one copy of the loop per case chain outcome
+        TheFPM->add(createSimpleLoopUnswitchLegacyPass(true));
+        TheFPM->add(createIndVarSimplifyPass());
+        TheFPM->add(createLoopUnrollPass(2));
+        TheFPM->add(createLoopVectorizePass());
+        TheFPM->add(createSLPVectorizerPass());
+        TheFPM->add(createInstructionCombiningPass());
+    }
+    
     TheFPM->doInitialization();
     
 }
@@ -651,15 +956,20 @@ AllocaInst *CreateEntryBlockAlloca(Type *type, Function *TheFunction, const stri
 }
 
 AllocaInst *FindVarInTable(std::string Name) {
-    AllocaInst* Var = nullptr;
-    if((Var = NamedValues[Name]) == nullptr) {
-        for (int i = NamedValuesVec.size()-1; i >= 0; --i) {
-            auto VarIter = NamedValuesVec[i].find(Name); 
-            if (VarIter != NamedValuesVec[i].end()) {
-                Var = VarIter->second;
-                break;
-            }
-        }
+    //find, not operator[]: an inserted null entry would hide outer scopes
+    //from blocks nested deeper than this one
+    if (TheStats.Enabled)
+        TheStats.SymbolLookups++;
+    auto VarIter = NamedValues.find(Name);
+    if (VarIter != NamedValues.end())
+        return VarIter->second;
+    for (int i = DeclScopes.size()-1; i >= 0; --i) {
+        if (TheStats.Enabled)
+            TheStats.ScopeProbes++;
+        auto &Scope = NamedValuesVec[DeclScopes[i]];
+        VarIter = Scope.find(Name); 
+        if (VarIter != Scope.end())
+            return VarIter->second;
     }
-    return Var;
+    return nullptr;
 }
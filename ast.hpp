@@ -11,7 +11,15 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Pass.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/SimpleLoopUnswitch.h"
+#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Vectorize.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Target/TargetOptions.h"
@@ -22,11 +30,100 @@ using namespace llvm;
 using namespace llvm::legacy;
 using namespace std;
 
+class ExprAST;
+class BytecodeCompiler;
+struct CompileFrame;
+
+/* State of the C backend: output stream, indentation and a counter used
+   to generate unique names for temporaries introduced by lowering.
+   emitC does not print, it queues text, indentation changes and children
+   in output order, and run() prints the queue from an explicit stack, so
+   nesting depth is not limited by the C++ stack. */
+class CEmitter {
+public:
+    CEmitter(ostream &os)
+        : OS(os), Indent(0), Counter(0)
+    {}
+    ostream &line();
+    CEmitter &text(const string &s);
+    //text at the start of a new line
+    CEmitter &indented(const string &s);
+    CEmitter &indent(int d);
+    CEmitter &node(const ExprAST *e);
+    //statements print their own lines, expressions need indent and ';'
+    CEmitter &stmt(const ExprAST *e);
+    //a block's statements wrapped in braces, current line already started
+    CEmitter &braced(const ExprAST *e);
+    //helpers giving the generated C the IR's int and compare semantics
+    void prelude();
+    void run();
+    ostream &OS;
+    int Indent;
+    int Counter;
+private:
+    struct Item {
+        enum { Text, Line, Indent, Node } Kind;
+        string S;
+        int Delta;
+        const ExprAST *E;
+    };
+    vector<Item> Queue;
+    vector<Item> Stack;
+};
+
+/* One node on the codegen stack. codegenStep is entered again each time
+   a child it asked for with call() has been generated, with the child's
+   value in Child, until it finishes with done(). The other fields are
+   scratch space for the node across those steps. */
+struct CodegenFrame {
+    bool call(const ExprAST *e, unsigned resume) {
+        Next = e;
+        Step = resume;
+        return false;
+    }
+    bool done(Value *v) {
+        Result = v;
+        return true;
+    }
+    const ExprAST *Node;
+    unsigned Step;
+    const ExprAST *Next;
+    Value *Child;
+    Value *Result;
+    Value *Val;
+    size_t Index;
+    unsigned Count;
+    BasicBlock *BB[4];
+    vector<Value*> Vals;
+    vector<BasicBlock*> BBs;
+};
 
 class ExprAST {
 public:
-  	virtual Value* codegen() const = 0;
+  	//generates the tree from an explicit stack of CodegenFrames
+  	Value* codegen() const;
+  	virtual bool codegenStep(CodegenFrame &F) const = 0;
+  	//a node below this one failed to generate
+  	virtual void codegenFailed() const {}
+  	virtual void emitC(CEmitter &E) const = 0;
+  	//--run: bytecode from an explicit stack of CompileFrames, as codegen
+  	virtual bool compileStep(BytecodeCompiler &B, CompileFrame &F) const = 0;
+  	virtual bool isStmt() const { return false; }
+  	//appends the direct subexpressions, for walks over the tree
+  	virtual void children(vector<const ExprAST*> &out) const {}
+  	//moves the owned subexpressions to out, so deleting them needs no recursion
+  	virtual void releaseChildren(vector<ExprAST*> &out) {}
+  	//--specialize: a copy of the node still pointing at this one's
+  	//children, which the caller replaces through childSlots
+  	virtual ExprAST *cloneNode() const = 0;
+  	virtual void childSlots(vector<ExprAST**> &out) {}
+  	//adds the heap blocks the node owns besides its children, --mem-report
+  	virtual void ownedBytes(size_t &Buffers, size_t &Strings) const {}
   	virtual ~ExprAST() {}
+  	//where the node starts in the source, 0 for nodes the parser did not make
+  	void setLoc(unsigned line, unsigned col) { Line = line; Col = col; }
+  	unsigned Line = 0;
+  	unsigned Col = 0;
 };
 
 class VariableExprAST : public ExprAST {
@@ -34,7 +131,12 @@ public:
 	VariableExprAST(const string &n)
 		:Name(n)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
+	const string &getName() const { return Name; }
 private:
   	string Name;
 };
@@ -44,7 +146,11 @@ public:
 	IntNumberExprAST(int v)
 		:Val(v)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	int getVal() const { return Val; }
 private:
 	int Val;
 };
@@ -54,7 +160,10 @@ public:
 	DoubleNumberExprAST(double v)
 		:Val(v)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
 private:
 	double Val;
 };
@@ -69,10 +178,15 @@ public:
 	InnerExprAST(ExprAST* e1, ExprAST* e2, ExprAST* e3);
 	InnerExprAST(ExprAST* e1, ExprAST* e2, ExprAST* e3, ExprAST* e4);
 	~InnerExprAST();
+	void children(vector<const ExprAST*> &out) const;
+	void releaseChildren(vector<ExprAST*> &out);
+	void childSlots(vector<ExprAST**> &out);
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
 private:
 	InnerExprAST(const InnerExprAST&);
 	InnerExprAST& operator=(const InnerExprAST&);
 protected:
+	void emitBinaryC(CEmitter &E, const char *Op) const;
   	vector<ExprAST*> Vec;
 };
 
@@ -81,87 +195,137 @@ public:
 	BlockAST(vector<ExprAST *> e) 
         : InnerExprAST(e) 
     {}
-	Value *codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void codegenFailed() const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	void emitCBody(CEmitter &E, Type *RetType) const;
+	vector<ExprAST*> &statements() { return Vec; }
 };
 
-class AddExprAST : public InnerExprAST {
+/* Both operands are generated left to right, then combined by build. */
+class BinaryExprAST : public InnerExprAST {
 public:
-	AddExprAST(ExprAST* l, ExprAST *r)
+	BinaryExprAST(ExprAST* l, ExprAST *r)
 		:InnerExprAST(l, r)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+protected:
+	virtual Value* build(Value *l, Value *r) const = 0;
+	//the bytecode instruction, by operand type
+	virtual unsigned opcode(bool Double) const = 0;
+};
+
+class AddExprAST : public BinaryExprAST {
+public:
+	AddExprAST(ExprAST* l, ExprAST *r)
+		:BinaryExprAST(l, r)
+	{}
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class SubExprAST : public InnerExprAST {
+class SubExprAST : public BinaryExprAST {
 public:
 	SubExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class MulExprAST : public InnerExprAST {
+class MulExprAST : public BinaryExprAST {
 public:
 	MulExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class DivExprAST : public InnerExprAST {
+class DivExprAST : public BinaryExprAST {
 public:
 	DivExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class LtExprAST : public InnerExprAST {
+class LtExprAST : public BinaryExprAST {
 public:
 	LtExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class GtExprAST : public InnerExprAST {
+class GtExprAST : public BinaryExprAST {
 public:
 	GtExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class EqExprAST : public InnerExprAST {
+class EqExprAST : public BinaryExprAST {
 public:
 	EqExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class NeExprAST : public InnerExprAST {
+class NeExprAST : public BinaryExprAST {
 public:
 	NeExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class LeExprAST : public InnerExprAST {
+class LeExprAST : public BinaryExprAST {
 public:
 	LeExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
-class GeExprAST : public InnerExprAST {
+class GeExprAST : public BinaryExprAST {
 public:
 	GeExprAST(ExprAST* l, ExprAST *r)
-		:InnerExprAST(l, r)
+		:BinaryExprAST(l, r)
 	{}
-	Value* codegen() const;
+	Value* build(Value *l, Value *r) const;
+	void emitC(CEmitter &E) const;
+	unsigned opcode(bool Double) const;
+	ExprAST *cloneNode() const;
 };
 
 class CallExprAST : public InnerExprAST {
@@ -169,7 +333,14 @@ public:
 	CallExprAST(std::string c, const vector<ExprAST*> &v)
 		:InnerExprAST(v), Callee(c)
 	{ }
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
+	const string &getCallee() const { return Callee; }
+	void setCallee(const string &c) { Callee = c; }
+	const vector<ExprAST*> &getArgs() const { return Vec; }
 private:
   	string Callee;
 };
@@ -179,7 +350,24 @@ public:
   WhileExprAST(ExprAST *e1, ExprAST *e2)
     :InnerExprAST(e1, e2)
   {}
-  Value* codegen() const;
+  bool codegenStep(CodegenFrame &F) const;
+  void emitC(CEmitter &E) const;
+  bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+  ExprAST *cloneNode() const;
+  bool isStmt() const { return true; }
+};
+
+/* for (init; cond; step) { body }, any of the three heads may be missing. */
+class ForExprAST : public InnerExprAST {
+public:
+	ForExprAST(ExprAST *init, ExprAST *cond, ExprAST *step, ExprAST *body)
+		:InnerExprAST(init, cond, step, body)
+	{}
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	bool isStmt() const { return true; }
 };
 
 class IfExprAST : public InnerExprAST {
@@ -187,19 +375,42 @@ public:
 	IfExprAST(ExprAST* cond, ExprAST *e1, ExprAST *e2)
 		:InnerExprAST(cond, e1, e2)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	bool isStmt() const { return true; }
 };
 
 class SwitchExprAST : public ExprAST {
 public:
     SwitchExprAST(ExprAST* condition, std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> &cases)
-        : Condition(condition), Cases(cases)
+        : Condition(condition), Cases(std::move(cases))
     {}
-    Value* codegen() const;
+    ~SwitchExprAST();
+    bool codegenStep(CodegenFrame &F) const;
+    void emitC(CEmitter &E) const;
+    bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+    ExprAST *cloneNode() const;
+    bool isStmt() const { return true; }
+    void children(vector<const ExprAST*> &out) const;
+    void releaseChildren(vector<ExprAST*> &out);
+    void childSlots(vector<ExprAST**> &out);
+    void ownedBytes(size_t &Buffers, size_t &Strings) const;
+    const std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> &getCases() const { return Cases; }
+    const ExprAST *getCondition() const { return Condition; }
+    //hands case i's body over, the switch no longer deletes it
+    ExprAST *takeBody(size_t i) {
+        ExprAST *b = Cases[i].first.second;
+        Cases[i].first.second = nullptr;
+        return b;
+    }
 private:
+    SwitchExprAST(const SwitchExprAST&);
+    SwitchExprAST& operator=(const SwitchExprAST&);
     ExprAST* Condition;
-    std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> &Cases;
-    
+    std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> Cases;
+
 };
 
 class AssignExprAST : public InnerExprAST {
@@ -207,7 +418,12 @@ public:
 	AssignExprAST(std::string s, ExprAST* e)
 		:InnerExprAST(e), VarName(s)
 	{}
-	Value* codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
+	const std::string &getName() const { return VarName; }
 private:
  	std::string VarName;
 };
@@ -217,8 +433,26 @@ public:
     DeclAndAssignExprAST(Type* t, std::string n, ExprAST* e)
         : Expr(e), VarType(t), VarName(n)
     {}
-    Value *codegen() const;
+    ~DeclAndAssignExprAST();
+    bool codegenStep(CodegenFrame &F) const;
+    void emitC(CEmitter &E) const;
+    bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+    ExprAST *cloneNode() const;
+    bool isStmt() const { return true; }
+    string getName() const { return VarName; }
+    void children(vector<const ExprAST*> &out) const { out.push_back(Expr); }
+    void releaseChildren(vector<ExprAST*> &out) {
+        if (Expr != nullptr)
+            out.push_back(Expr);
+        Expr = nullptr;
+    }
+    void childSlots(vector<ExprAST**> &out) { out.push_back(&Expr); }
+    void ownedBytes(size_t &Buffers, size_t &Strings) const;
 private:
+    //stores the generated initialiser
+    bool assign(Value *Val, CodegenFrame &F) const;
+    DeclAndAssignExprAST(const DeclAndAssignExprAST&);
+    DeclAndAssignExprAST& operator=(const DeclAndAssignExprAST&);
     Type* VarType;
     std::string VarName;
     ExprAST* Expr;
@@ -239,7 +473,13 @@ private:
 class DeclExprAST : public ExprAST {
 public:
 	DeclExprAST(Type *t, std::vector<std::string> v) : Types(t), Vec(v) {}
-	Value *codegen() const;
+	bool codegenStep(CodegenFrame &F) const;
+	void emitC(CEmitter &E) const;
+	bool compileStep(BytecodeCompiler &B, CompileFrame &F) const;
+	ExprAST *cloneNode() const;
+	bool isStmt() const { return true; }
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
+	const vector<string> &getNames() const { return Vec; }
 
 private:
 	Type *Types;
@@ -250,13 +490,24 @@ class PrototypeAST {
 public:
 	PrototypeAST(Type *t, std::string n, std::vector<TypeAST *> a)
 		: Type(t), Name(n), Args(a) {}
+	~PrototypeAST();
 	Function *codegen() const;
-    Type* getType(){
+	void emitC(CEmitter &E) const;
+    Type* getType() const {
         return Type;
     }
 	string getName() const { return Name; }
+	size_t arg_size() const { return Args.size(); }
+	llvm::Type *getArgType(size_t i) const { return Args[i]->type; }
+	const string &getArgName(size_t i) const { return Args[i]->VarName; }
+	void ownedBytes(size_t &Buffers, size_t &Strings) const;
+	void setLoc(unsigned line, unsigned col) { Line = line; Col = col; }
+	unsigned Line = 0;
+	unsigned Col = 0;
 
 private:
+	PrototypeAST(const PrototypeAST&);
+	PrototypeAST& operator=(const PrototypeAST&);
 	Type *Type;
 	std::string Name;
 	std::vector<TypeAST*> Args;
@@ -267,6 +518,12 @@ public:
 	FunctionAST(PrototypeAST *p, ExprAST *b) : Proto(p), Body(b) {}
 	~FunctionAST();
 	Function *codegen() const;
+	void emitC(CEmitter &E) const;
+	void children(vector<const ExprAST*> &out) const { out.push_back(Body); }
+	string getName() const { return Proto->getName(); }
+	const PrototypeAST *getProto() const { return Proto; }
+	const ExprAST *getBody() const { return Body; }
+	ExprAST *getBody() { return Body; }
 
 private:
 	FunctionAST(const FunctionAST &f);
@@ -275,7 +532,10 @@ private:
 	ExprAST *Body;
 };
 
-void TheFpmAndModuleInit();
+//0: no passes, 1: reassociate, 2: also mem2reg and the loop pipeline
+void TheFpmAndModuleInit(int OptLevel = 1);
+
+const char *CTypeName(Type *t);
 
 AllocaInst *CreateEntryBlockAlloca(Type *type, Function *TheFunction, const string &VarName);
 
@@ -0,0 +1,413 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <map>
+#include <ctime>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Benchmark driver for swi2else.
+
+   bench gen  writes a synthetic input to stdout: N functions, each a
+              switch of K cases nested D deep, with case labels spread so
+              that K/range equals the requested density and a given share
+              of cases falling through.
+   bench run  generates inputs over a sweep of those parameters and times
+              swi2else on each, at each optimisation level asked for. The
+              phases come from the run's own --stats=json timers; start-up
+              is the wall time outside them, process creation and LLVM
+              initialisation. Peak RSS and output size come from the same
+              run. Results go to CSV and JSON so runs of different
+              versions can be compared. */
+
+using namespace std;
+
+struct GenParams {
+    unsigned Functions = 100;
+    unsigned Cases = 8;
+    unsigned Depth = 1;
+    double Density = 1.0;
+    double Fallthrough = 0.25;
+    unsigned Seed = 1;
+};
+
+static vector<int> CaseLabels(mt19937 &rng, const GenParams &p) {
+    unsigned range = (unsigned)ceil(p.Cases / max(min(p.Density, 1.0), 1e-6));
+    vector<int> labels;
+    if (range == p.Cases) {
+        for (unsigned i = 0; i < p.Cases; i++)
+            labels.push_back(i);
+        return labels;
+    }
+    //Floyd's sampling: K distinct values out of [0, range)
+    vector<bool> used(range, false);
+    for (unsigned j = range - p.Cases; j < range; j++) {
+        unsigned t = uniform_int_distribution<unsigned>(0, j)(rng);
+        unsigned v = used[t] ? j : t;
+        used[v] = true;
+        labels.push_back(v);
+    }
+    sort(labels.begin(), labels.end());
+    return labels;
+}
+
+static void Indent(ostream &os, unsigned n) {
+    for (unsigned i = 0; i < n; i++)
+        os << "    ";
+}
+
+//one switch, its first case holds the next level so size stays linear in D
+static void GenSwitch(ostream &os, mt19937 &rng, const GenParams &p, unsigned fn,
+                      unsigned depth, unsigned ind) {
+    uniform_real_distribution<double> coin(0.0, 1.0);
+    vector<int> labels = CaseLabels(rng, p);
+
+    Indent(os, ind);
+    os << "switch (" << (depth == 1 ? "x" : "r") << ") {\n";
+    for (unsigned i = 0; i < labels.size(); i++) {
+        Indent(os, ind + 1);
+        os << "case " << labels[i] << ":\n";
+        if (i == 0 && depth < p.Depth)
+            GenSwitch(os, rng, p, fn, depth + 1, ind + 2);
+        Indent(os, ind + 2);
+        os << "r = r + " << labels[i] + 1 << ";\n";
+        if (coin(rng) >= p.Fallthrough) {
+            Indent(os, ind + 2);
+            os << "break;\n";
+        }
+    }
+    Indent(os, ind + 1);
+    os << "default:\n";
+    Indent(os, ind + 2);
+    if (fn > 0 && depth == 1)
+        os << "r = f" << fn - 1 << "(r);\n";
+    else
+        os << "r = r - 1;\n";
+    Indent(os, ind);
+    os << "}\n";
+}
+
+static void Generate(ostream &os, const GenParams &p) {
+    mt19937 rng(p.Seed);
+    for (unsigned f = 0; f < p.Functions; f++) {
+        os << "int f" << f << "(int x) {\n";
+        os << "    int r = 0;\n";
+        GenSwitch(os, rng, p, f, 1, 1);
+        os << "    r;\n";
+        os << "}\n\n";
+    }
+}
+
+struct RunResult {
+    double Ms;
+    long RssKB;
+    long OutBytes;
+    bool Ok;
+    //--stats=json phase times in ms
+    map<string, double> Phases;
+};
+
+//the flat "phases" object of a --stats=json report, seconds to ms
+static map<string, double> ReadPhases(const string &path) {
+    map<string, double> phases;
+    ifstream is(path);
+    stringstream ss;
+    ss << is.rdbuf();
+    string s = ss.str();
+    size_t p = s.find("\"phases\"");
+    if (p == string::npos)
+        return phases;
+    size_t end = s.find('}', p);
+    p = s.find('{', p);
+    while ((p = s.find('"', p + 1)) < end) {
+        size_t q = s.find('"', p + 1);
+        string name = s.substr(p + 1, q - p - 1);
+        p = s.find(':', q);
+        phases[name] = strtod(s.c_str() + p + 1, nullptr) * 1000;
+    }
+    return phases;
+}
+
+static RunResult RunOnce(const string &exe, const vector<string> &args,
+                         const string &input, const string &output) {
+    RunResult res = { 0, 0, 0, false, {} };
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        return res;
+    if (pid == 0) {
+        int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            _exit(127);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        vector<char*> argv;
+        argv.push_back((char*)exe.c_str());
+        for (auto &a : args)
+            argv.push_back((char*)a.c_str());
+        argv.push_back((char*)input.c_str());
+        argv.push_back(nullptr);
+        execv(exe.c_str(), argv.data());
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+        return res;
+    auto end = chrono::steady_clock::now();
+    res.Ms = chrono::duration<double, milli>(end - start).count();
+    res.RssKB = ru.ru_maxrss;
+    struct stat st;
+    if (stat(output.c_str(), &st) == 0)
+        res.OutBytes = st.st_size;
+    res.Ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return res;
+}
+
+//best of Repeat runs, the minimum is the least noisy estimate; the
+//phases are those of the fastest run
+static RunResult RunBest(const string &exe, const vector<string> &args, const string &input,
+                         const string &output, const string &stats, unsigned repeat) {
+    RunResult best = { 0, 0, 0, false, {} };
+    vector<string> all = args;
+    all.push_back("--stats=json");
+    all.push_back("--stats-file=" + stats);
+    for (unsigned i = 0; i < repeat; i++) {
+        RunResult r = RunOnce(exe, all, input, output);
+        if (!r.Ok)
+            return r;
+        if (i == 0 || r.Ms < best.Ms) {
+            best.Ms = r.Ms;
+            best.Phases = ReadPhases(stats);
+        }
+        best.RssKB = max(best.RssKB, r.RssKB);
+        best.OutBytes = r.OutBytes;
+        best.Ok = true;
+    }
+    return best;
+}
+
+struct Row {
+    GenParams P;
+    unsigned OptLevel;
+    long InBytes;
+    double Startup, Lex, Parse, Codegen, Opt, Print, Total;
+    long RssKB;
+    long OutBytes;
+};
+
+template <typename T>
+static vector<T> ParseList(const string &s) {
+    vector<T> v;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) {
+        stringstream is(item);
+        T x;
+        if (!(is >> x)) {
+            cerr << "Bad list value: " << item << endl;
+            exit(EXIT_FAILURE);
+        }
+        v.push_back(x);
+    }
+    return v;
+}
+
+static void Usage() {
+    cerr << "Usage: bench gen [--functions N] [--cases K] [--density F] [--depth D]\n"
+            "                 [--fallthrough F] [--seed S]\n"
+            "       bench run [--swi2else PATH] [--csv FILE] [--json FILE] [--repeat R]\n"
+            "                 [--opt O,...] [--functions N,...] [--cases K,...] [--density F,...]\n"
+            "                 [--depth D,...] [--fallthrough F,...] [--seed S]" << endl;
+    exit(EXIT_FAILURE);
+}
+
+static int Gen(int argc, char **argv) {
+    GenParams p;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+            Usage();
+        string val = argv[++i];
+        if (arg == "--functions")
+            p.Functions = stoul(val);
+        else if (arg == "--cases")
+            p.Cases = max(1ul, stoul(val));
+        else if (arg == "--density")
+            p.Density = stod(val);
+        else if (arg == "--depth")
+            p.Depth = max(1ul, stoul(val));
+        else if (arg == "--fallthrough")
+            p.Fallthrough = stod(val);
+        else if (arg == "--seed")
+            p.Seed = stoul(val);
+        else
+            Usage();
+    }
+    Generate(cout, p);
+    return 0;
+}
+
+static void WriteCSV(const string &path, const vector<Row> &rows) {
+    ofstream os(path);
+    os << "functions,cases,density,depth,fallthrough,opt_level,input_bytes,startup_ms,lex_ms,"
+          "parse_ms,codegen_ms,opt_ms,print_ms,total_ms,peak_rss_kb,output_bytes\n";
+    for (auto &r : rows)
+        os << r.P.Functions << "," << r.P.Cases << "," << r.P.Density << "," << r.P.Depth << ","
+           << r.P.Fallthrough << "," << r.OptLevel << "," << r.InBytes << "," << r.Startup << ","
+           << r.Lex << "," << r.Parse << "," << r.Codegen << "," << r.Opt << "," << r.Print << ","
+           << r.Total << "," << r.RssKB << "," << r.OutBytes << "\n";
+}
+
+static void WriteJSON(const string &path, const string &exe, const vector<Row> &rows) {
+    ofstream os(path);
+    os << "{\n  \"swi2else\": \"" << exe << "\",\n  \"time\": " << time(nullptr)
+       << ",\n  \"results\": [\n";
+    for (unsigned i = 0; i < rows.size(); i++) {
+        const Row &r = rows[i];
+        os << "    {\"functions\": " << r.P.Functions << ", \"cases\": " << r.P.Cases
+           << ", \"density\": " << r.P.Density << ", \"depth\": " << r.P.Depth
+           << ", \"fallthrough\": " << r.P.Fallthrough << ", \"opt_level\": " << r.OptLevel
+           << ", \"input_bytes\": " << r.InBytes << ", \"startup_ms\": " << r.Startup
+           << ", \"lex_ms\": " << r.Lex << ", \"parse_ms\": " << r.Parse
+           << ", \"codegen_ms\": " << r.Codegen << ", \"opt_ms\": " << r.Opt
+           << ", \"print_ms\": " << r.Print << ", \"total_ms\": " << r.Total << ", \"peak_rss_kb\": " << r.RssKB
+           << ", \"output_bytes\": " << r.OutBytes << "}" << (i + 1 < rows.size() ? "," : "")
+           << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+static int Run(int argc, char **argv) {
+    string exe = "./swi2else", csv = "bench/results.csv", json = "bench/results.json";
+    unsigned repeat = 3, seed = 1;
+    vector<unsigned> functions = { 100, 1000, 10000 }, cases = { 8, 32 }, depth = { 1, 3 };
+    vector<double> density = { 1.0 }, fallthrough = { 0.25 };
+    vector<unsigned> opt = { 1, 2 };
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+            Usage();
+        string val = argv[++i];
+        if (arg == "--swi2else")
+            exe = val;
+        else if (arg == "--csv")
+            csv = val;
+        else if (arg == "--json")
+            json = val;
+        else if (arg == "--repeat")
+            repeat = max(1ul, stoul(val));
+        else if (arg == "--seed")
+            seed = stoul(val);
+        else if (arg == "--opt")
+            opt = ParseList<unsigned>(val);
+        else if (arg == "--functions")
+            functions = ParseList<unsigned>(val);
+        else if (arg == "--cases")
+            cases = ParseList<unsigned>(val);
+        else if (arg == "--density")
+            density = ParseList<double>(val);
+        else if (arg == "--depth")
+            depth = ParseList<unsigned>(val);
+        else if (arg == "--fallthrough")
+            fallthrough = ParseList<double>(val);
+        else
+            Usage();
+    }
+
+    char dir[] = "/tmp/swi2else-bench-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        cerr << "Cannot create temporary directory" << endl;
+        return EXIT_FAILURE;
+    }
+    string input = string(dir) + "/input.c", output = string(dir) + "/output";
+    string stats = string(dir) + "/stats.json";
+
+    vector<Row> rows;
+    cout << "functions cases density depth fallthr  O    input start_ms   lex_ms parse_ms  cg_ms  opt_ms"
+            " print_ms  total_ms  rss_kb  out_bytes" << endl;
+    for (unsigned f : functions)
+    for (unsigned k : cases)
+    for (double d : density)
+    for (unsigned dp : depth)
+    for (double ft : fallthrough) {
+        GenParams P;
+        P.Functions = f;
+        P.Cases = max(1u, k);
+        P.Density = d;
+        P.Depth = max(1u, dp);
+        P.Fallthrough = ft;
+        P.Seed = seed;
+        {
+            ofstream os(input);
+            Generate(os, P);
+        }
+        struct stat st;
+        long inBytes = stat(input.c_str(), &st) == 0 ? st.st_size : 0;
+
+        for (unsigned o : opt) {
+            RunResult run = RunBest(exe, { "-O" + to_string(o) }, input, output, stats, repeat);
+            if (!run.Ok) {
+                cerr << exe << " failed on functions=" << f << " cases=" << k << " density=" << d
+                     << " depth=" << dp << " fallthrough=" << ft << " -O" << o
+                     << ", input kept in " << input << endl;
+                return EXIT_FAILURE;
+            }
+            Row r;
+            r.P = P;
+            r.OptLevel = o;
+            r.InBytes = inBytes;
+            //"total" covers the translation, the rest of the wall time is
+            //process start-up and LLVM initialisation
+            r.Lex = run.Phases["lex"];
+            r.Parse = run.Phases["parse"];
+            r.Codegen = run.Phases["codegen"] + run.Phases["verify"];
+            r.Opt = run.Phases["optimize"];
+            r.Print = run.Phases["print"];
+            r.Startup = max(0.0, run.Ms - run.Phases["total"]);
+            r.Total = run.Ms;
+            r.RssKB = run.RssKB;
+            r.OutBytes = run.OutBytes;
+            rows.push_back(r);
+
+            printf("%9u %5u %7.3g %5u %7.3g %2u %8ld %8.2f %8.2f %8.2f %6.2f %7.2f %8.2f %9.2f %7ld %10ld\n",
+                   f, k, d, dp, ft, o, r.InBytes, r.Startup, r.Lex, r.Parse, r.Codegen, r.Opt,
+                   r.Print, r.Total, r.RssKB, r.OutBytes);
+            fflush(stdout);
+        }
+    }
+
+    unlink(input.c_str());
+    unlink(output.c_str());
+    unlink(stats.c_str());
+    rmdir(dir);
+
+    WriteCSV(csv, rows);
+    WriteJSON(json, exe, rows);
+    cout << "Results written to " << csv << " and " << json << endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        Usage();
+    string cmd = argv[1];
+    if (cmd == "gen")
+        return Gen(argc, argv);
+    if (cmd == "run")
+        return Run(argc, argv);
+    Usage();
+    return EXIT_FAILURE;
+}
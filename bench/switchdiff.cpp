@@ -0,0 +1,421 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "ast.hpp"
+#include "input.hpp"
+#include "frontend.hpp"
+#include "parser.tab.hpp"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/Transforms/Utils.h"
+
+/* Differential harness for the switch lowering.
+
+   Every switch in the input files is turned into two kernels int(int sel)
+   that share its case labels, default and breaks. Case bodies are replaced
+   by t = t * 31 + case number, so the returned t records exactly which
+   bodies ran and in what order. The reference kernel is built directly
+   with a SwitchInst; the other goes through SwitchExprAST::codegen, the
+   lowering swi2else ships. Both get mem2reg and nothing else, are JIT
+   compiled, and are run over uniform, skewed (hot cases first) and
+   adversarial (late cases and misses, in random order) selectors plus
+   every label, its neighbours and the int extremes. Any difference in t
+   is reported and makes the exit status 1. Each distribution is also
+   timed, in ns per dispatch, with branch mispredicts per dispatch from
+   perf_event_open when the kernel lets us count them. */
+
+extern LLVMContext TheContext;
+extern IRBuilder<> Builder;
+extern Module* TheModule;
+extern legacy::FunctionPassManager* TheFPM;
+
+//referenced by the front end, unused here
+CEmitter* TheCEmitter = nullptr;
+StopPhase StopAfter = StopNever;
+
+typedef std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> CaseVector;
+typedef int (*Kernel)(int);
+
+struct SwitchShape {
+    std::string Function;
+    std::vector<int> Labels;    //per case, unused for the default
+    std::vector<bool> Breaks;
+    int Default;                //index of the default case, -1 if none
+};
+
+struct Options {
+    unsigned Count = 100000;
+    unsigned Repeat = 5;
+    unsigned Seed = 1;
+    std::string Csv;
+    std::vector<std::string> Files;
+};
+
+static std::vector<TopLevelItem> ParseFile(const std::string &path) {
+    SourceBuffer b;
+    if (!b.open(path)) {
+        std::cerr << "Cannot read " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    ParseContext ctx(true);
+    void *scanner = LexBegin(b, 1);
+    yyparse(scanner, &ctx);
+    LexEnd(scanner);
+    return ctx.take();
+}
+
+static void CollectSwitches(const FunctionAST *f, std::vector<SwitchShape> &out) {
+    std::vector<const ExprAST*> work;
+    f->children(work);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        e->children(work);
+        auto sw = dynamic_cast<const SwitchExprAST*>(e);
+        if (sw == nullptr)
+            continue;
+        SwitchShape s = { f->getName(), {}, {}, -1 };
+        std::set<int> seen;
+        bool ok = true;
+        for (auto &c : sw->getCases()) {
+            int label = 0;
+            if (c.first.first == nullptr) {
+                ok = ok && s.Default < 0;
+                s.Default = s.Labels.size();
+            }
+            else {
+                label = static_cast<const IntNumberExprAST*>(c.first.first)->getVal();
+                ok = ok && seen.insert(label).second;
+            }
+            s.Labels.push_back(label);
+            s.Breaks.push_back(c.second);
+        }
+        if (ok)
+            out.push_back(s);
+        else
+            std::cerr << "Skipping a switch in " << s.Function
+                      << ": repeated case label or default" << std::endl;
+    }
+}
+
+//t = t * 31 + n, the only side effect of case n
+static ExprAST *TraceStep(unsigned n) {
+    return new AssignExprAST("t", new AddExprAST(
+        new MulExprAST(new VariableExprAST("t"), new IntNumberExprAST(31)),
+        new IntNumberExprAST(n)));
+}
+
+//the lowering under test: the same AST codegen swi2else runs on its input
+static void BuildLowered(const SwitchShape &s, const std::string &name) {
+    Type *I32 = Type::getInt32Ty(TheContext);
+    CaseVector cases;
+    for (unsigned i = 0; i < s.Labels.size(); i++) {
+        ExprAST *label = (int)i == s.Default ? nullptr : new IntNumberExprAST(s.Labels[i]);
+        cases.push_back({ { label, new BlockAST({ TraceStep(i + 1) }) }, s.Breaks[i] });
+    }
+    std::vector<ExprAST*> body = {
+        new DeclExprAST(I32, { "t" }),
+        new SwitchExprAST(new VariableExprAST("sel"), cases),
+        new VariableExprAST("t")
+    };
+    FunctionAST f(new PrototypeAST(I32, name, { new TypeAST(I32, "sel") }), new BlockAST(body));
+    f.codegen();
+}
+
+//C semantics spelled out with a SwitchInst: a case without break falls
+//into the next body in source order
+static void BuildReference(const SwitchShape &s, const std::string &name) {
+    Type *I32 = Type::getInt32Ty(TheContext);
+    Function *F = Function::Create(FunctionType::get(I32, { I32 }, false),
+                                   Function::ExternalLinkage, name, TheModule);
+    Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", F));
+    AllocaInst *T = Builder.CreateAlloca(I32, nullptr, "t");
+    Builder.CreateStore(ConstantInt::get(I32, 0), T);
+
+    std::vector<BasicBlock*> Bodies;
+    for (unsigned i = 0; i < s.Labels.size(); i++)
+        Bodies.push_back(BasicBlock::Create(TheContext, "case", F));
+    BasicBlock *Exit = BasicBlock::Create(TheContext, "exit", F);
+
+    SwitchInst *SI = Builder.CreateSwitch(F->getArg(0), s.Default >= 0 ? Bodies[s.Default] : Exit,
+                                          s.Labels.size());
+    for (unsigned i = 0; i < s.Labels.size(); i++) {
+        if ((int)i != s.Default)
+            SI->addCase(cast<ConstantInt>(ConstantInt::getSigned(I32, s.Labels[i])), Bodies[i]);
+    }
+    for (unsigned i = 0; i < s.Labels.size(); i++) {
+        Builder.SetInsertPoint(Bodies[i]);
+        Value *t = Builder.CreateLoad(I32, T, "t");
+        t = Builder.CreateAdd(Builder.CreateMul(t, ConstantInt::get(I32, 31)),
+                              ConstantInt::get(I32, i + 1));
+        Builder.CreateStore(t, T);
+        bool last = i + 1 == s.Labels.size();
+        Builder.CreateBr(s.Breaks[i] || last ? Exit : Bodies[i + 1]);
+    }
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRet(Builder.CreateLoad(I32, T, "t"));
+    verifyFunction(*F);
+}
+
+//values no case label matches, to exercise the default path
+static std::vector<int> Misses(const SwitchShape &s) {
+    std::set<long long> labels;
+    for (unsigned i = 0; i < s.Labels.size(); i++)
+        if ((int)i != s.Default)
+            labels.insert(s.Labels[i]);
+    if (labels.empty())
+        return { 0, 1, -1 };
+    std::vector<long long> cand = { *labels.begin() - 1, *labels.rbegin() + 1 };
+    for (long long v = *labels.begin(); v < *labels.rbegin() && cand.size() < 4; v++)
+        if (!labels.count(v))
+            cand.push_back(v);
+    std::vector<int> out;
+    for (long long v : cand)
+        if (v >= INT_MIN && v <= INT_MAX && !labels.count(v))
+            out.push_back((int)v);
+    return out;
+}
+
+//labels in the order the if/else chain tests them
+static std::vector<int> TestOrder(const SwitchShape &s) {
+    std::vector<int> out;
+    for (unsigned i = 0; i < s.Labels.size(); i++)
+        if ((int)i != s.Default)
+            out.push_back(s.Labels[i]);
+    return out;
+}
+
+static std::vector<int> Distribution(const std::string &kind, const SwitchShape &s,
+                                     unsigned count, std::mt19937 &rng) {
+    std::vector<int> labels = TestOrder(s);
+    std::vector<int> misses = Misses(s);
+    std::vector<int> pool;
+    std::vector<double> weights;
+    if (kind == "uniform") {
+        //every label and one miss value equally likely
+        pool = labels;
+        pool.push_back(misses[0]);
+        weights.assign(pool.size(), 1.0);
+    }
+    else if (kind == "skewed") {
+        //Zipf over the labels, the first one tested is the hottest
+        pool = labels;
+        pool.push_back(misses[0]);
+        for (unsigned i = 0; i < pool.size(); i++)
+            weights.push_back(1.0 / (i + 1));
+    }
+    else {
+        //the last quarter of the chain and misses, which walk all of it
+        size_t from = labels.size() - (labels.size() + 3) / 4;
+        pool.assign(labels.begin() + from, labels.end());
+        pool.insert(pool.end(), misses.begin(), misses.end());
+        weights.assign(pool.size(), 1.0);
+    }
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    std::vector<int> out(count);
+    for (auto &v : out)
+        v = pool[pick(rng)];
+    return out;
+}
+
+static int OpenMispredictCounter() {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_BRANCH_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+struct Timing {
+    double Ns;
+    double Misses;      //negative when there is no counter
+};
+
+//best of Repeat runs; the mispredicts are those of the fastest run
+static Timing TimeKernel(Kernel f, const std::vector<int> &sel, unsigned repeat, int fd) {
+    Timing best = { 1e300, -1 };
+    volatile int sink = 0;
+    for (unsigned r = 0; r < repeat; r++) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        auto start = std::chrono::steady_clock::now();
+        int sum = 0;
+        for (int v : sel)
+            sum += f(v);
+        auto end = std::chrono::steady_clock::now();
+        uint64_t misses = 0;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+                misses = 0;
+        }
+        sink = sum;
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / sel.size();
+        if (ns < best.Ns)
+            best = { ns, fd >= 0 ? (double)misses / sel.size() : -1 };
+    }
+    (void)sink;
+    return best;
+}
+
+static void Usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " [--count N] [--repeat R] [--seed S] [--csv FILE] FILE..."
+              << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool more = i + 1 < argc;
+        if (arg == "--count" && more)
+            o.Count = atoi(argv[++i]);
+        else if (arg == "--repeat" && more)
+            o.Repeat = atoi(argv[++i]);
+        else if (arg == "--seed" && more)
+            o.Seed = atoi(argv[++i]);
+        else if (arg == "--csv" && more)
+            o.Csv = argv[++i];
+        else if (arg[0] != '-')
+            o.Files.push_back(arg);
+        else
+            Usage(argv[0]);
+    }
+    if (o.Files.empty() || o.Count == 0 || o.Repeat == 0)
+        Usage(argv[0]);
+
+    std::vector<SwitchShape> shapes;
+    for (auto &f : o.Files) {
+        for (auto &item : ParseFile(f)) {
+            if (item.Func)
+                CollectSwitches(item.Func, shapes);
+            delete item.Func;
+            delete item.Proto;
+        }
+    }
+    if (shapes.empty()) {
+        std::cerr << "No switches found" << std::endl;
+        return 0;
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    TheFpmAndModuleInit(0);
+    for (unsigned i = 0; i < shapes.size(); i++) {
+        BuildReference(shapes[i], "reference_" + std::to_string(i));
+        BuildLowered(shapes[i], "lowered_" + std::to_string(i));
+    }
+    //allocas to registers on both sides, no pass that could rebuild the switch
+    legacy::FunctionPassManager FPM(TheModule);
+    FPM.add(createPromoteMemoryToRegisterPass());
+    FPM.doInitialization();
+    for (auto &F : *TheModule)
+        FPM.run(F);
+    FPM.doFinalization();
+
+    std::string err;
+    ExecutionEngine *EE = EngineBuilder(std::unique_ptr<Module>(TheModule))
+        .setErrorStr(&err).setOptLevel(CodeGenOpt::Aggressive).create();
+    TheModule = nullptr;
+    if (EE == nullptr) {
+        std::cerr << "Cannot create the JIT: " << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    EE->finalizeObject();
+
+    int fd = OpenMispredictCounter();
+    if (fd < 0)
+        std::cerr << "Branch mispredicts not available: " << strerror(errno) << std::endl;
+
+    std::ofstream csv;
+    if (!o.Csv.empty()) {
+        csv.open(o.Csv);
+        csv << "switch,function,cases,distribution,strategy,ns_per_dispatch,mispredicts_per_dispatch\n";
+    }
+
+    const char *kinds[] = { "uniform", "skewed", "adversarial" };
+    std::mt19937 rng(o.Seed);
+    unsigned long long checked = 0, mismatches = 0;
+    printf("%-6s %-20s %5s  %-12s %-8s %12s %12s\n", "switch", "function", "cases",
+           "distribution", "strategy", "ns/dispatch", "miss/dispatch");
+
+    for (unsigned i = 0; i < shapes.size(); i++) {
+        const SwitchShape &s = shapes[i];
+        Kernel ref = (Kernel)EE->getFunctionAddress("reference_" + std::to_string(i));
+        Kernel low = (Kernel)EE->getFunctionAddress("lowered_" + std::to_string(i));
+
+        std::vector<std::vector<int>> dists;
+        for (auto k : kinds)
+            dists.push_back(Distribution(k, s, o.Count, rng));
+
+        //equivalence: every distribution plus the edges
+        std::vector<int> edges = { 0, INT_MIN, INT_MAX };
+        for (int l : s.Labels) {
+            edges.push_back(l);
+            if (l > INT_MIN)
+                edges.push_back(l - 1);
+            if (l < INT_MAX)
+                edges.push_back(l + 1);
+        }
+        dists.push_back(edges);
+        unsigned reported = 0;
+        for (auto &d : dists) {
+            for (int v : d) {
+                checked++;
+                int a = ref(v), b = low(v);
+                if (a == b)
+                    continue;
+                mismatches++;
+                if (reported++ < 5)
+                    printf("MISMATCH switch %u in %s: selector %d, switch gives %d, if/else gives %d\n",
+                           i, s.Function.c_str(), v, a, b);
+            }
+        }
+        dists.pop_back();
+
+        for (unsigned k = 0; k < dists.size(); k++) {
+            Kernel fns[] = { ref, low };
+            const char *names[] = { "switch", "if-else" };
+            for (unsigned j = 0; j < 2; j++) {
+                Timing t = TimeKernel(fns[j], dists[k], o.Repeat, fd);
+                char misses[32];
+                if (t.Misses < 0)
+                    snprintf(misses, sizeof(misses), "n/a");
+                else
+                    snprintf(misses, sizeof(misses), "%.4f", t.Misses);
+                printf("%-6u %-20s %5zu  %-12s %-8s %12.3f %12s\n", i, s.Function.c_str(),
+                       s.Labels.size(), kinds[k], names[j], t.Ns, misses);
+                if (csv.is_open())
+                    csv << i << "," << s.Function << "," << s.Labels.size() << "," << kinds[k] << ","
+                        << names[j] << "," << t.Ns << "," << (t.Misses < 0 ? "" : misses) << "\n";
+            }
+        }
+    }
+
+    printf("%zu switches, %llu selectors checked, %llu mismatches\n", shapes.size(), checked,
+           mismatches);
+    delete EE;
+    if (fd >= 0)
+        close(fd);
+    return mismatches ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,600 @@
+#include <algorithm>
+#include <cstring>
+#include "bytecode.hpp"
+
+/* Bytecode compiler: the nodes' compileStep and the register, scope and
+   jump bookkeeping they use. Nothing here touches TheModule or the
+   IRBuilder. Errors stop the run with codegen's messages. */
+
+void yyerror(string s);
+
+extern LLVMContext TheContext;
+
+BytecodeCompiler *TheBytecode = nullptr;
+
+const unsigned BytecodeCompiler::NoReg;
+const uint32_t BytecodeCompiler::NoJump;
+
+const unsigned char OpLength[OpCount] = {
+#define VM_LENGTH(Name, Operands) sizeof(Operands),
+    VM_OPCODES(VM_LENGTH)
+#undef VM_LENGTH
+};
+
+const char *const OpOperands[OpCount] = {
+#define VM_FORMAT(Name, Operands) Operands,
+    VM_OPCODES(VM_FORMAT)
+#undef VM_FORMAT
+};
+
+//calls f on the address of every register operand in Code from From on
+template <class Fn>
+static void ForEachRegister(std::vector<uint32_t> &Code, size_t From, Fn f) {
+    for (size_t pc = From; pc < Code.size(); pc += OpLength[Code[pc]]) {
+        const char *k = OpOperands[Code[pc]];
+        for (size_t i = 0; k[i]; i++)
+            if (k[i] == 'r')
+                f(Code[pc + 1 + i]);
+    }
+}
+
+static bool IsCompare(unsigned Op) {
+    return Op >= OpLtInt && Op <= OpNeDouble;
+}
+
+//the first operand is the register the instruction writes
+static bool WritesFirst(unsigned Op) {
+    return Op <= OpNeDouble || Op == OpCall;
+}
+
+int VMProgram::find(const std::string &Name) const {
+    auto It = Index.find(Name);
+    return It == Index.end() ? -1 : (int)It->second;
+}
+
+unsigned BytecodeCompiler::declare(const PrototypeAST *P) {
+    int i = Program.find(P->getName());
+    if (i >= 0)
+        return i;
+    VMFunction Fn;
+    Fn.Name = P->getName();
+    Fn.Ret = P->getType();
+    for (size_t a = 0; a < P->arg_size(); a++) {
+        Fn.Params.push_back(P->getArgType(a));
+        Fn.ParamNames.push_back(P->getArgName(a));
+    }
+    Fn.Defined = false;
+    Fn.Registers = 0;
+    Program.Index[Fn.Name] = Program.Functions.size();
+    Program.Functions.push_back(std::move(Fn));
+    return Program.Functions.size() - 1;
+}
+
+void BytecodeCompiler::function(const FunctionAST *Func) {
+    Current = declare(Func->getProto());
+    VMFunction &Fn = current();
+    if (Fn.Defined)
+        yyerror("Function redefinition is not allowed " + Fn.Name);
+
+    //the arguments are the outermost scope, the body's block opens its own
+    NextReg = VarTop = 0;
+    Last = NoJump;
+    Pins.clear();
+    Constants.clear();
+    Scopes.assign(1, Scope());
+    Scopes[0].VarTop = 0;
+    DeclScopes.clear();
+    //a repeated argument name means the first, LLVM renames the others
+    for (size_t i = 0; i < Fn.Params.size(); i++) {
+        Scopes[0].Vars.insert({ Fn.ParamNames[i], { NextReg, Fn.Params[i] } });
+        VarTop = ++NextReg;
+    }
+    if (!Fn.Params.empty())
+        DeclScopes.push_back(0);
+    Fn.Registers = NextReg;
+
+    VMValue V = compile(Func->getBody());
+    if (Fn.Ret == Type::getVoidTy(TheContext))
+        emit(OpReturnVoid, {});
+    else if (V.Ty != Fn.Ret)
+        yyerror("Function " + Fn.Name + " must return the type it is declared with");
+    else
+        emit(OpReturn, { use(V) });
+
+    //the constants go above every other register
+    unsigned Base = Fn.Registers;
+    ForEachRegister(Fn.Code, 0, [Base](uint32_t &r) {
+        if (isConstant(r))
+            r = Base + (r & ~ConstantTag);
+    });
+    Fn.Registers += Fn.Constants.size();
+    Fn.Defined = true;
+}
+
+//the tree is walked from Frames, as in ExprAST::codegen
+VMValue BytecodeCompiler::compile(const ExprAST *E) {
+    size_t Base = Depth;
+    const ExprAST *Next = E;
+    for (;;) {
+        if (Next != nullptr) {
+            if (Depth == Frames.size())
+                Frames.emplace_back();
+            CompileFrame &N = Frames[Depth++];
+            N.Node = Next;
+            N.Step = 0;
+            N.Next = nullptr;
+            N.Child = N.Result = N.Val = zero(nullptr);
+            N.Index = 0;
+            N.Mark = 0;
+            N.Pinned = false;
+            N.Jump = N.Head = NoJump;
+            N.Targets.clear();
+            N.Exits.clear();
+        }
+        CompileFrame &F = Frames[Depth - 1];
+        if (!F.Node->compileStep(*this, F)) {
+            Next = F.Next;
+            continue;
+        }
+        Next = nullptr;
+        VMValue V = F.Result;
+        Depth--;
+        if (Depth == Base)
+            return V;
+        Frames[Depth - 1].Child = V;
+    }
+}
+
+uint32_t BytecodeCompiler::emit(Opcode Op, std::initializer_list<uint32_t> Operands) {
+    std::vector<uint32_t> &Code = current().Code;
+    Last = Code.size();
+    Code.push_back(Op);
+    Code.insert(Code.end(), Operands.begin(), Operands.end());
+    return Last;
+}
+
+uint32_t BytecodeCompiler::label() {
+    Last = NoJump;
+    return current().Code.size();
+}
+
+void BytecodeCompiler::patch(uint32_t At) {
+    std::vector<uint32_t> &Code = current().Code;
+    Code[At + OpLength[Code[At]] - 1] = label();
+}
+
+uint32_t BytecodeCompiler::branchUnless(VMValue Cond, const char *What) {
+    std::vector<uint32_t> &Code = current().Code;
+    if (Cond.Ty == Type::getInt32Ty(TheContext))
+        return emit(OpJumpIfIntNonZero, { use(Cond), 0 });
+    if (Cond.Ty != Type::getDoubleTy(TheContext))
+        yyerror(string(What) + " condition must be int or double!");
+    //a compare's 0.0 or 1.0 is never NaN, so the compare itself decides
+    if (Last != NoJump && IsCompare(Code[Last]) && Code[Last + 1] == Cond.Reg && !Cond.Var) {
+        uint32_t l = Code[Last + 2], r = Code[Last + 3];
+        unsigned Op = Code[Last] - OpLtInt + OpJumpUnlessLtInt;
+        Code.resize(Last);
+        return emit((Opcode)Op, { l, r, 0 });
+    }
+    return emit(OpJumpIfDoubleFalse, { use(Cond), 0 });
+}
+
+unsigned BytecodeCompiler::temp() {
+    VMFunction &Fn = current();
+    if (NextReg == Fn.Registers)
+        Fn.Registers++;
+    return NextReg++;
+}
+
+VMValue BytecodeCompiler::constant(Type *T, VMSlot V) {
+    uint64_t Bits = 0;
+    if (T == Type::getDoubleTy(TheContext))
+        memcpy(&Bits, &V.D, sizeof(double));
+    else
+        Bits = (uint32_t)V.I;
+    auto It = Constants.insert({ { T, Bits }, (unsigned)Constants.size() });
+    if (It.second) {
+        current().Constants.push_back(V);
+        current().ConstantTypes.push_back(T);
+    }
+    return { ConstantTag | It.first->second, T, false };
+}
+
+unsigned BytecodeCompiler::use(VMValue V) {
+    if (V.Reg != NoReg)
+        return V.Reg;
+    if (V.Ty != Type::getDoubleTy(TheContext) && V.Ty != Type::getInt32Ty(TheContext))
+        yyerror("Error matching types!");
+    VMSlot Zero;
+    if (V.Ty == Type::getDoubleTy(TheContext))
+        Zero.D = 0;
+    else
+        Zero.I = 0;
+    return constant(V.Ty, Zero).Reg;
+}
+
+void BytecodeCompiler::moveTo(unsigned Dst, VMValue V) {
+    unsigned r = use(V);
+    if (r == Dst)
+        return;
+    std::vector<uint32_t> &Code = current().Code;
+    if (!V.Var && !isConstant(r) && Last != NoJump && WritesFirst(Code[Last]) && Code[Last + 1] == r)
+        Code[Last + 1] = Dst;
+    else
+        emit(OpMove, { Dst, r });
+}
+
+VMValue BytecodeCompiler::declareVar(const std::string &Name, Type *T) {
+    if (T != Type::getInt32Ty(TheContext) && T != Type::getDoubleTy(TheContext))
+        yyerror("Codegen err");
+    Scope &S = Scopes.back();
+    if (S.Vars.count(Name))
+        yyerror("Var " + Name + " already exist! Redefinition of variable not allowed");
+    //above any temporary still live in the statement
+    unsigned r = temp();
+    VarTop = NextReg;
+    if (S.Vars.empty())
+        DeclScopes.push_back(Scopes.size() - 1);
+    S.Vars[Name] = { r, T };
+    emit(OpMove, { r, use(zero(T)) });
+    return { r, T, true };
+}
+
+void BytecodeCompiler::dropZero(uint32_t At, unsigned Reg) {
+    std::vector<uint32_t> &Code = current().Code;
+    bool Read = false;
+    ForEachRegister(Code, At + OpLength[OpMove], [&Read, Reg](uint32_t &r) { Read |= r == Reg; });
+    if (Read)
+        return;
+    //the initialiser is an expression, no jump leads into it
+    Code.erase(Code.begin() + At, Code.begin() + At + OpLength[OpMove]);
+    if (Last != NoJump)
+        Last = Last == At ? NoJump : Last - OpLength[OpMove];
+}
+
+VMValue BytecodeCompiler::lookup(const std::string &Name) const {
+    for (size_t i = DeclScopes.size(); i-- > 0;) {
+        const Scope &S = Scopes[DeclScopes[i]];
+        auto It = S.Vars.find(Name);
+        if (It != S.Vars.end())
+            return { It->second.Reg, It->second.Ty, true };
+    }
+    return { NoReg, nullptr, false };
+}
+
+void BytecodeCompiler::assign(VMValue Var, VMValue V) {
+    if (Var.Reg < Pins.size() && Pins[Var.Reg] != 0) {
+        //the pending left operands take the value from before
+        for (size_t i = 0; i < Depth; i++) {
+            CompileFrame &L = Frames[i];
+            if (L.Pinned && L.Val.Reg == Var.Reg) {
+                unsigned t = temp();
+                emit(OpMove, { t, L.Val.Reg });
+                L.Val = { t, L.Val.Ty, false };
+                L.Pinned = false;
+            }
+        }
+        Pins[Var.Reg] = 0;
+    }
+    moveTo(Var.Reg, V);
+}
+
+void BytecodeCompiler::pin(unsigned Reg) {
+    if (Reg >= Pins.size())
+        Pins.resize(Reg + 1, 0);
+    Pins[Reg]++;
+}
+
+void BytecodeCompiler::unpin(unsigned Reg) {
+    Pins[Reg]--;
+}
+
+void BytecodeCompiler::pushScope() {
+    Scopes.push_back(Scope());
+    Scopes.back().VarTop = VarTop;
+}
+
+void BytecodeCompiler::popScope() {
+    VarTop = Scopes.back().VarTop;
+    Scopes.pop_back();
+    if (!DeclScopes.empty() && DeclScopes.back() == Scopes.size())
+        DeclScopes.pop_back();
+}
+
+void BytecodeCompiler::release(unsigned Mark) {
+    NextReg = std::max(Mark, VarTop);
+}
+
+VMValue BytecodeCompiler::keep(VMValue V, unsigned Mark) {
+    release(Mark);
+    if (V.Reg == NoReg || isConstant(V.Reg) || V.Reg < NextReg)
+        return V;
+    moveTo(NextReg, V);
+    return { temp(), V.Ty, false };
+}
+
+//dense when at least 40% of the range between the lowest and highest
+//label are labels, as for LLVM's jump tables
+unsigned BytecodeCompiler::dispatch(unsigned Sel, const std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> &Cases) {
+    //label and case index; for a repeated label the first case wins, as
+    //in the compare chain
+    std::vector<std::pair<int32_t, uint32_t>> Labels;
+    for (size_t i = 0; i < Cases.size(); i++)
+        if (Cases[i].first.first != nullptr)
+            Labels.push_back({ static_cast<const IntNumberExprAST*>(Cases[i].first.first)->getVal(), i });
+    std::stable_sort(Labels.begin(), Labels.end(),
+        [](const std::pair<int32_t, uint32_t> &a, const std::pair<int32_t, uint32_t> &b) { return a.first < b.first; });
+    Labels.erase(std::unique(Labels.begin(), Labels.end(),
+        [](const std::pair<int32_t, uint32_t> &a, const std::pair<int32_t, uint32_t> &b) { return a.first == b.first; }),
+        Labels.end());
+
+    SwitchTable T;
+    T.Default = NoJump;
+    T.Min = Labels.empty() ? 0 : Labels.front().first;
+    int64_t Range = Labels.empty() ? 0 : (int64_t)Labels.back().first - T.Min + 1;
+    T.Dense = !Labels.empty() && Range * 4 <= (int64_t)Labels.size() * 10;
+    if (T.Dense) {
+        T.Targets.assign(Range, NoJump);
+        for (auto &l : Labels)
+            T.Targets[l.first - T.Min] = l.second;
+    }
+    else {
+        for (auto &l : Labels) {
+            T.Keys.push_back(l.first);
+            T.Targets.push_back(l.second);
+        }
+    }
+    std::vector<SwitchTable> &Tables = current().Tables;
+    Tables.push_back(std::move(T));
+    emit(Tables.back().Dense ? OpSwitchDense : OpSwitchSorted, { Sel, (uint32_t)Tables.size() - 1 });
+    return Tables.size() - 1;
+}
+
+//case indices become the bodies' offsets, holes and a missing default
+//go to the end of the switch
+void BytecodeCompiler::finishSwitch(unsigned Table, const std::vector<uint32_t> &Bodies, int DefaultCase) {
+    SwitchTable &T = current().Tables[Table];
+    uint32_t End = label();
+    T.Default = DefaultCase < 0 ? End : Bodies[DefaultCase];
+    for (auto &t : T.Targets)
+        t = t == NoJump ? T.Default : Bodies[t];
+}
+
+bool IntNumberExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    VMSlot V;
+    V.I = Val;
+    return F.done(B.constant(Type::getInt32Ty(TheContext), V));
+}
+
+bool DoubleNumberExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    VMSlot V;
+    V.D = Val;
+    return F.done(B.constant(Type::getDoubleTy(TheContext), V));
+}
+
+bool VariableExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    VMValue V = B.lookup(Name);
+    if (!V.Var)
+        yyerror("Variable " + Name + " does not exist!");
+    return F.done(V);
+}
+
+bool BlockAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    if (F.Step == 0) {
+        B.pushScope();
+        F.Mark = B.mark();
+    }
+    else if (F.Index < Vec.size()) {
+        B.release(F.Mark);
+    }
+
+    //the value of the block is the value of its last statement
+    if (F.Index < Vec.size())
+        return F.call(Vec[F.Index++], 1);
+
+    B.popScope();
+    return F.done(B.keep(F.Child, F.Mark));
+}
+
+bool BinaryExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    switch (F.Step) {
+    case 0:
+        return F.call(Vec[0], 1);
+    case 1:
+        F.Val = F.Child;
+        F.Pinned = F.Val.Var;
+        if (F.Pinned)
+            B.pin(F.Val.Reg);
+        return F.call(Vec[1], 2);
+    default: {
+        if (F.Pinned)
+            B.unpin(F.Val.Reg);
+        Type *T = F.Val.Ty;
+        if (T != F.Child.Ty)
+            yyerror("Types must match!");
+        bool Double = T == Type::getDoubleTy(TheContext);
+        if (!Double && T != Type::getInt32Ty(TheContext))
+            yyerror("Error matching types!");
+        unsigned Op = opcode(Double);
+        unsigned l = B.use(F.Val), r = B.use(F.Child), d = B.temp();
+        B.emit((Opcode)Op, { d, l, r });
+        return F.done({ d, IsCompare(Op) ? Type::getDoubleTy(TheContext) : T, false });
+    }
+    }
+}
+
+unsigned AddExprAST::opcode(bool Double) const { return Double ? OpAddDouble : OpAddInt; }
+unsigned SubExprAST::opcode(bool Double) const { return Double ? OpSubDouble : OpSubInt; }
+unsigned MulExprAST::opcode(bool Double) const { return Double ? OpMulDouble : OpMulInt; }
+unsigned DivExprAST::opcode(bool Double) const { return Double ? OpDivDouble : OpDivInt; }
+unsigned LtExprAST::opcode(bool Double) const { return Double ? OpLtDouble : OpLtInt; }
+unsigned GtExprAST::opcode(bool Double) const { return Double ? OpGtDouble : OpGtInt; }
+unsigned EqExprAST::opcode(bool Double) const { return Double ? OpEqDouble : OpEqInt; }
+unsigned NeExprAST::opcode(bool Double) const { return Double ? OpNeDouble : OpNeInt; }
+unsigned LeExprAST::opcode(bool Double) const { return Double ? OpLeDouble : OpLeInt; }
+unsigned GeExprAST::opcode(bool Double) const { return Double ? OpGeDouble : OpGeInt; }
+
+bool AssignExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    if (F.Step == 0)
+        return F.call(Vec[0], 1);
+    VMValue Var = B.lookup(VarName);
+    if (!Var.Var)
+        yyerror("Variable " + VarName + " does not exist");
+    if (F.Child.Ty != Var.Ty)
+        yyerror("Implicit conversion not allowed!");
+    B.assign(Var, F.Child);
+    return F.done(Var);
+}
+
+bool DeclAndAssignExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    //declared and zeroed before the initialiser runs, as in codegen
+    if (F.Step == 0) {
+        F.Jump = B.current().Code.size();
+        F.Val = B.declareVar(VarName, VarType);
+        return F.call(Expr, 1);
+    }
+    if (F.Child.Ty != F.Val.Ty)
+        yyerror("Implicit conversion not allowed!");
+    B.dropZero(F.Jump, F.Val.Reg);
+    B.assign(F.Val, F.Child);
+    return F.done(F.Val);
+}
+
+bool DeclExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    for (auto &Name : Vec)
+        B.declareVar(Name, Types);
+    return F.done(B.zero(Types));
+}
+
+bool CallExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    if (F.Step == 0) {
+        int Callee = B.Program.find(this->Callee);
+        if (Callee < 0)
+            yyerror("Function " + this->Callee + " does not exist");
+        size_t arg_size = B.Program.Functions[Callee].Params.size();
+        if (arg_size != Vec.size())
+            yyerror("Function " + this->Callee + " must be called with " + to_string(arg_size) + " arguments");
+        F.Jump = Callee;
+        //the arguments go to consecutive registers, the result to the first
+        F.Mark = B.mark();
+        for (size_t i = 0; i < std::max<size_t>(Vec.size(), 1); i++)
+            B.temp();
+    }
+    else {
+        size_t i = F.Index - 1;
+        if (F.Child.Ty != B.Program.Functions[F.Jump].Params[i])
+            yyerror("Argument " + to_string(i + 1) + " of " + this->Callee + " has the wrong type");
+        B.moveTo(F.Mark + i, F.Child);
+        B.release(F.Mark + std::max<size_t>(Vec.size(), 1));
+    }
+
+    //arguments left to right, then the call
+    if (F.Index < Vec.size())
+        return F.call(Vec[F.Index++], 1);
+    B.emit(OpCall, { F.Mark, F.Jump, F.Mark, (uint32_t)Vec.size() });
+    B.release(F.Mark + 1);
+    Type *Ret = B.Program.Functions[F.Jump].Ret;
+    if (Ret == Type::getVoidTy(TheContext))
+        return F.done(B.zero(Ret));
+    return F.done({ F.Mark, Ret, false });
+}
+
+//condition at the top, a jump back from the bottom; F.Head is the
+//condition and F.Jump the exit
+static bool LoopStep(BytecodeCompiler &B, CompileFrame &F, const ExprAST *Init, const ExprAST *Cond, const ExprAST *Step, const ExprAST *Body) {
+    switch (F.Step) {
+    case 0:
+        if (Init != nullptr)
+            return F.call(Init, 1);
+    //no init, falls through
+    LLVM_FALLTHROUGH;
+    case 1:
+        F.Head = B.label();
+        if (Cond != nullptr)
+            return F.call(Cond, 2);
+        return F.call(Body, 3);
+    case 2:
+        F.Jump = B.branchUnless(F.Child, "Loop");
+        return F.call(Body, 3);
+    case 3:
+        if (Step != nullptr)
+            return F.call(Step, 4);
+    }
+    //no step, falls through
+    B.emit(OpJump, { F.Head });
+    if (F.Jump != BytecodeCompiler::NoJump)
+        B.patch(F.Jump);
+    return F.done(B.zero(Type::getInt32Ty(TheContext)));
+}
+
+bool WhileExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    return LoopStep(B, F, nullptr, Vec[0], nullptr, Vec[1]);
+}
+
+bool ForExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    //a declaration in the init is visible in the loop only
+    if (F.Step == 0)
+        B.pushScope();
+    if (!LoopStep(B, F, Vec[0], Vec[1], Vec[2], Vec[3]))
+        return false;
+    B.popScope();
+    return true;
+}
+
+bool IfExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    switch (F.Step) {
+    case 0:
+        return F.call(Vec[0], 1);
+    case 1:
+        F.Jump = B.branchUnless(F.Child, "If");
+        return F.call(Vec[1], 2);
+    case 2:
+        if (Vec[2] != nullptr) {
+            uint32_t Skip = B.emit(OpJump, { 0 });
+            B.patch(F.Jump);
+            F.Jump = Skip;
+            return F.call(Vec[2], 3);
+        }
+    }
+    //no else, falls through
+    B.patch(F.Jump);
+    return F.done(B.zero(Type::getInt32Ty(TheContext)));
+}
+
+bool SwitchExprAST::compileStep(BytecodeCompiler &B, CompileFrame &F) const {
+    //F.Jump is the table, F.Targets the bodies and F.Exits the breaks
+    switch (F.Step) {
+    case 0:
+        return F.call(Condition, 1);
+    case 1: {
+        int num_of_default_cases = 0;
+        for (auto &c : Cases)
+            num_of_default_cases += c.first.first == nullptr;
+        if (num_of_default_cases > 1)
+            yyerror("Too much default cases! Only one allowed");
+        if (F.Child.Ty != Type::getInt32Ty(TheContext))
+            yyerror("Switch selector must be int!");
+        F.Jump = B.dispatch(B.use(F.Child), Cases);
+        break;
+    }
+    default:
+        //break leaves the switch, the last body falls out of it anyway
+        if (Cases[F.Index - 1].second && F.Index < Cases.size())
+            F.Exits.push_back(B.emit(OpJump, { 0 }));
+    }
+
+    //bodies in source order, so a case without break falls into the next
+    if (F.Index < Cases.size()) {
+        F.Targets.push_back(B.label());
+        return F.call(Cases[F.Index++].first.second, 2);
+    }
+
+    for (auto j : F.Exits)
+        B.patch(j);
+    int Default = -1;
+    for (size_t i = 0; i < Cases.size(); i++)
+        if (Cases[i].first.first == nullptr)
+            Default = i;
+    B.finishSwitch(F.Jump, F.Targets, Default);
+    return F.done(B.zero(Type::getInt32Ty(TheContext)));
+}
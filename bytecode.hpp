@@ -0,0 +1,247 @@
+#ifndef __BYTECODE_HPP__
+#define __BYTECODE_HPP__ 1
+
+#include <cstdint>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+
+/* --run and --emit=bytecode: the AST compiled to a register bytecode and
+   interpreted, without a module, pass manager or target, so a run starts
+   as soon as the input is parsed. Values are the same 32-bit ints and
+   doubles as in the IR and follow codegen's rules: unsigned division and
+   compares, compares giving 1.0 or 0.0, an int condition taking the then
+   branch when it is 0.
+
+   An instruction is its opcode followed by its operands, all 32-bit
+   words. The operand letters give their kinds: r register, t code
+   offset, s switch table, f function, n argument count. Constants live
+   in registers of their own, loaded once per call, so no instruction
+   needs an immediate form. A switch is one SwitchDense or
+   SwitchSorted dispatch through a table of its labels; case bodies follow
+   in source order, so fallthrough costs nothing. Compares feeding a
+   branch are fused into one JumpUnless instruction. */
+#define VM_OPCODES(X) \
+    X(Move, "rr") \
+    X(AddInt, "rrr") \
+    X(SubInt, "rrr") \
+    X(MulInt, "rrr") \
+    X(DivInt, "rrr") \
+    X(AddDouble, "rrr") \
+    X(SubDouble, "rrr") \
+    X(MulDouble, "rrr") \
+    X(DivDouble, "rrr") \
+    X(LtInt, "rrr") \
+    X(GtInt, "rrr") \
+    X(LeInt, "rrr") \
+    X(GeInt, "rrr") \
+    X(EqInt, "rrr") \
+    X(NeInt, "rrr") \
+    X(LtDouble, "rrr") \
+    X(GtDouble, "rrr") \
+    X(LeDouble, "rrr") \
+    X(GeDouble, "rrr") \
+    X(EqDouble, "rrr") \
+    X(NeDouble, "rrr") \
+    X(JumpUnlessLtInt, "rrt") \
+    X(JumpUnlessGtInt, "rrt") \
+    X(JumpUnlessLeInt, "rrt") \
+    X(JumpUnlessGeInt, "rrt") \
+    X(JumpUnlessEqInt, "rrt") \
+    X(JumpUnlessNeInt, "rrt") \
+    X(JumpUnlessLtDouble, "rrt") \
+    X(JumpUnlessGtDouble, "rrt") \
+    X(JumpUnlessLeDouble, "rrt") \
+    X(JumpUnlessGeDouble, "rrt") \
+    X(JumpUnlessEqDouble, "rrt") \
+    X(JumpUnlessNeDouble, "rrt") \
+    X(Jump, "t") \
+    X(JumpIfIntNonZero, "rt") \
+    X(JumpIfDoubleFalse, "rt") \
+    X(SwitchDense, "rs") \
+    X(SwitchSorted, "rs") \
+    X(Call, "rfrn") \
+    X(Return, "r") \
+    X(ReturnVoid, "")
+
+enum Opcode {
+#define VM_ENUM(Name, Operands) Op##Name,
+    VM_OPCODES(VM_ENUM)
+#undef VM_ENUM
+    OpCount
+};
+
+//words in an instruction, the opcode and its operands
+extern const unsigned char OpLength[OpCount];
+//the operand letters
+extern const char *const OpOperands[OpCount];
+
+/* The labels of one switch, code offsets in Targets. Dense tables are
+   indexed by selector - Min, with Default in the holes; sorted ones
+   binary search Keys. */
+struct SwitchTable {
+    bool Dense;
+    int32_t Min;
+    std::vector<int32_t> Keys;
+    std::vector<uint32_t> Targets;
+    uint32_t Default;
+};
+
+union VMSlot {
+    int32_t I;
+    double D;
+};
+
+struct VMFunction {
+    std::string Name;
+    Type *Ret;
+    std::vector<Type*> Params;
+    std::vector<std::string> ParamNames;
+    bool Defined;
+    //the arguments come first, Constants last
+    unsigned Registers;
+    std::vector<VMSlot> Constants;
+    std::vector<Type*> ConstantTypes;
+    std::vector<uint32_t> Code;
+    std::vector<SwitchTable> Tables;
+};
+
+/* Every function of the input, by the index Call instructions use. */
+struct VMProgram {
+    //-1 when Name was never declared
+    int find(const std::string &Name) const;
+    void print(std::ostream &os) const;
+    //calls Name, which takes no arguments, and prints what it returns
+    void run(const std::string &Name, std::ostream &os) const;
+    std::vector<VMFunction> Functions;
+    std::map<std::string, unsigned> Index;
+};
+
+/* A compiled value: the register holding it and its type. Statements
+   and declarations give a 0 without a register, the constant's is only
+   taken if the value is used. */
+struct VMValue {
+    unsigned Reg;
+    Type *Ty;
+    //Reg is a variable, not a copy of it
+    bool Var;
+};
+
+/* One node on the compile stack, as CodegenFrame for codegen. */
+struct CompileFrame {
+    bool call(const ExprAST *e, unsigned resume) {
+        Next = e;
+        Step = resume;
+        return false;
+    }
+    bool done(VMValue v) {
+        Result = v;
+        return true;
+    }
+    const ExprAST *Node;
+    unsigned Step;
+    const ExprAST *Next;
+    VMValue Child;
+    VMValue Result;
+    VMValue Val;
+    size_t Index;
+    unsigned Mark;
+    //Val is a variable's register, see BytecodeCompiler::pin
+    bool Pinned;
+    uint32_t Jump;
+    uint32_t Head;
+    std::vector<uint32_t> Targets;
+    std::vector<uint32_t> Exits;
+};
+
+/* Compiles top-level items into Program as the parser hands them over.
+   Registers are handed out upwards: a variable keeps its own for its
+   scope, temporaries are released after each statement of a block. */
+class BytecodeCompiler {
+public:
+    static const unsigned NoReg = ~0u;
+    static const uint32_t NoJump = ~0u;
+    BytecodeCompiler(VMProgram &p)
+        : Program(p), Current(0), NextReg(0), VarTop(0), Depth(0), Last(NoJump)
+    {}
+    //the function's index, declared as codegen would on first sight
+    unsigned declare(const PrototypeAST *P);
+    void function(const FunctionAST *Func);
+
+    //for the nodes' compileStep
+    VMFunction &current() { return Program.Functions[Current]; }
+    uint32_t emit(Opcode Op, std::initializer_list<uint32_t> Operands);
+    //the next instruction's offset, a jump target
+    uint32_t label();
+    //points the jump at At to the next instruction
+    void patch(uint32_t At);
+    //a jump taken when Cond does not select the then branch or loop body
+    uint32_t branchUnless(VMValue Cond, const char *What);
+    unsigned temp();
+    VMValue constant(Type *T, VMSlot V);
+    //the register holding V, the zero constant's for values without one
+    unsigned use(VMValue V);
+    VMValue zero(Type *T) const { return { NoReg, T, false }; }
+    //V to register Dst, by retargeting the instruction that computed it
+    //when it is the last one
+    void moveTo(unsigned Dst, VMValue V);
+    //a new variable in the innermost scope, zeroed
+    VMValue declareVar(const std::string &Name, Type *T);
+    //drops the zeroing at At of a variable its initialiser does not read
+    void dropZero(uint32_t At, unsigned Reg);
+    //Var is false when Name is not in scope
+    VMValue lookup(const std::string &Name) const;
+    void assign(VMValue Var, VMValue V);
+    //a binary operator's left operand is a variable its right one may
+    //assign, the assignment then copies the old value to the frame first
+    void pin(unsigned Reg);
+    void unpin(unsigned Reg);
+    void pushScope();
+    void popScope();
+    unsigned mark() const { return NextReg; }
+    //frees the temporaries above Mark
+    void release(unsigned Mark);
+    //V as a block's value: its temporaries are released and V is kept in
+    //the lowest of them
+    VMValue keep(VMValue V, unsigned Mark);
+    //the dispatch of a switch on Sel, body targets resolved by finishSwitch
+    unsigned dispatch(unsigned Sel, const std::vector<std::pair<std::pair<ExprAST*, ExprAST*>, bool>> &Cases);
+    void finishSwitch(unsigned Table, const std::vector<uint32_t> &Bodies, int DefaultCase);
+
+    VMProgram &Program;
+private:
+    VMValue compile(const ExprAST *E);
+    static bool isConstant(unsigned Reg) { return Reg != NoReg && (Reg & ConstantTag); }
+    //constants are numbered from ConstantTag until the function's
+    //register count is known
+    static const unsigned ConstantTag = 1u << 31;
+    struct Variable {
+        unsigned Reg;
+        Type *Ty;
+    };
+    struct Scope {
+        std::map<std::string, Variable> Vars;
+        unsigned VarTop;
+    };
+    unsigned Current;
+    unsigned NextReg;
+    //above the registers of the variables in scope
+    unsigned VarTop;
+    std::vector<Scope> Scopes;
+    //indices of the scopes that declare something, so a lookup from deep
+    //inside nested blocks skips the empty ones between
+    std::vector<size_t> DeclScopes;
+    std::vector<unsigned> Pins;
+    std::map<std::pair<Type*, uint64_t>, unsigned> Constants;
+    std::vector<CompileFrame> Frames;
+    size_t Depth;
+    //offset of the last instruction, NoJump after a label
+    uint32_t Last;
+};
+
+//set while --run or --emit=bytecode is on
+extern BytecodeCompiler *TheBytecode;
+
+#endif
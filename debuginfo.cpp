@@ -0,0 +1,92 @@
+#include "debuginfo.hpp"
+#include "ast.hpp"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+
+extern LLVMContext TheContext;
+extern IRBuilder<> Builder;
+
+DebugInfo *TheDebugInfo = nullptr;
+
+DebugInfo::DebugInfo(Module &M, const std::string &Path, bool Optimized)
+    : DBuilder(M), CU(nullptr), File(nullptr), Int(nullptr), Double(nullptr),
+      Optimized(Optimized), Body(nullptr)
+{
+    setFile(Path);
+    CU = DBuilder.createCompileUnit(dwarf::DW_LANG_C99, File, "swi2else", Optimized, "", 0);
+    Int = DBuilder.createBasicType("int", 32, dwarf::DW_ATE_signed);
+    Double = DBuilder.createBasicType("double", 64, dwarf::DW_ATE_float);
+    M.addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    M.addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+}
+
+//paths are kept as given, relative to the directory swi2else ran in
+void DebugInfo::setFile(const std::string &Path) {
+    DIFile *&F = Files[Path];
+    if (F == nullptr) {
+        SmallString<128> Dir;
+        sys::fs::current_path(Dir);
+        F = DBuilder.createFile(Path == "-" ? "<stdin>" : Path, Dir);
+    }
+    File = F;
+}
+
+//void has no type, it is a null entry in a subroutine type
+DIType *DebugInfo::typeOf(Type *T) {
+    if (T->isIntegerTy())
+        return Int;
+    if (T->isDoubleTy())
+        return Double;
+    return nullptr;
+}
+
+void DebugInfo::beginFunction(Function *F, const PrototypeAST *P, const ExprAST *B) {
+    SmallVector<Metadata*, 8> Types;
+    FunctionType *FT = F->getFunctionType();
+    Types.push_back(typeOf(FT->getReturnType()));
+    for (Type *T : FT->params())
+        Types.push_back(typeOf(T));
+    DISubroutineType *Ty = DBuilder.createSubroutineType(DBuilder.getOrCreateTypeArray(Types));
+    DISubprogram *SP = DBuilder.createFunction(File, F->getName(), StringRef(), File, P->Line, Ty,
+        B->Line, DINode::FlagPrototyped,
+        DISubprogram::SPFlagDefinition | (Optimized ? DISubprogram::SPFlagOptimized : DISubprogram::SPFlagZero));
+    F->setSubprogram(SP);
+    Body = B;
+    Scopes.assign(1, SP);
+    //the prologue, arguments stored to their slots, is on the prototype's line
+    Builder.SetCurrentDebugLocation(DILocation::get(F->getContext(), P->Line, P->Col, SP));
+}
+
+void DebugInfo::endFunction() {
+    DBuilder.finalizeSubprogram(cast<DISubprogram>(Scopes[0]));
+    Scopes.clear();
+    Body = nullptr;
+    Builder.SetCurrentDebugLocation(DebugLoc());
+}
+
+//blocks nested deeper share the innermost lexical block; the verifier
+//walks each location's scope chain, which would make deep input quadratic
+static const size_t MaxScopeDepth = 64;
+
+void DebugInfo::pushBlock(const ExprAST *E) {
+    if (E == Body)
+        return;
+    if (Scopes.size() >= MaxScopeDepth)
+        Scopes.push_back(Scopes.back());
+    else
+        Scopes.push_back(DBuilder.createLexicalBlock(Scopes.back(), File, E->Line, E->Col));
+}
+
+void DebugInfo::popBlock(const ExprAST *E) {
+    if (E != Body)
+        Scopes.pop_back();
+}
+
+void DebugInfo::setLocation(const ExprAST *E) {
+    if (E->Line != 0 && !Scopes.empty())
+        Builder.SetCurrentDebugLocation(DILocation::get(TheContext, E->Line, E->Col, Scopes.back()));
+}
+
+void DebugInfo::finalize() {
+    DBuilder.finalize();
+}
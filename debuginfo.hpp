@@ -0,0 +1,47 @@
+#ifndef __DEBUGINFO_HPP__
+#define __DEBUGINFO_HPP__ 1
+
+#include <map>
+#include <string>
+#include <vector>
+#include "llvm/IR/DIBuilder.h"
+
+class ExprAST;
+class PrototypeAST;
+
+/* -g: DWARF for the generated IR, so profiles of the compiled output point
+   back at the source. There is a compile unit per module, a file per input,
+   a subprogram per function and a lexical block per nested block or for
+   loop. Every codegen step sets the location of the node it generates, and
+   the compares and bodies of a switch carry their case's position, so the
+   if/else chain shows which arm samples belong to. */
+class DebugInfo {
+public:
+    DebugInfo(llvm::Module &M, const std::string &Path, bool Optimized);
+    //the input the following functions come from
+    void setFile(const std::string &Path);
+    void beginFunction(llvm::Function *F, const PrototypeAST *P, const ExprAST *Body);
+    void endFunction();
+    //a block's scope, not pushed for the function body itself
+    void pushBlock(const ExprAST *E);
+    void popBlock(const ExprAST *E);
+    //later instructions get E's position, nodes without one leave it as is
+    void setLocation(const ExprAST *E);
+    void finalize();
+private:
+    llvm::DIType *typeOf(llvm::Type *T);
+    llvm::DIBuilder DBuilder;
+    llvm::DICompileUnit *CU;
+    llvm::DIFile *File;
+    std::map<std::string, llvm::DIFile*> Files;
+    llvm::DIType *Int;
+    llvm::DIType *Double;
+    bool Optimized;
+    const ExprAST *Body;
+    std::vector<llvm::DIScope*> Scopes;
+};
+
+//set while -g is on
+extern DebugInfo *TheDebugInfo;
+
+#endif
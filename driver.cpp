@@ -0,0 +1,447 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+#include "ast.hpp"
+#include "input.hpp"
+#include "frontend.hpp"
+#include "stats.hpp"
+#include "memreport.hpp"
+#include "serve.hpp"
+#include "stream.hpp"
+#include "switchpass.hpp"
+#include "debuginfo.hpp"
+#include "bytecode.hpp"
+#include "specialize.hpp"
+#include "parser.tab.hpp"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/SourceMgr.h"
+
+extern LLVMContext TheContext;
+extern Module* TheModule;
+extern legacy::FunctionPassManager* TheFPM;
+
+//set by --emit=c, functions are printed as C instead of lowered to IR
+CEmitter* TheCEmitter = nullptr;
+
+StopPhase StopAfter = StopNever;
+
+static void ParseBuffer(SourceBuffer &b, ParseContext &ctx, int line, int col) {
+    double start = TheStats.Enabled ? Stats::now() : 0;
+    void *scanner = LexBegin(b, line, col);
+    if (StopAfter == StopAfterLex) {
+        YYSTYPE lval;
+        YYLTYPE lloc;
+        while (yylex(&lval, &lloc, scanner) != 0)
+            ctx.Tokens++;
+        ctx.LexTime += TheStats.Enabled ? Stats::now() - start : 0;
+    }
+    else {
+        yyparse(scanner, &ctx);
+    }
+    LexEnd(scanner);
+    if (TheStats.Enabled)
+        ctx.ParseTime += Stats::now() - start - ctx.LexTime - ctx.HandleTime;
+}
+
+//parse threads keep their own numbers, merged here on the main thread
+static void MergeParseStats(const ParseContext &ctx) {
+    if (!TheStats.Enabled)
+        return;
+    TheStats.Tokens += ctx.Tokens;
+    TheStats.Phases["lex"] += ctx.LexTime;
+    TheStats.Phases["parse"] += ctx.ParseTime;
+}
+
+//splits the file at top-level declarations and parses the pieces on
+//Jobs threads; the ASTs are then handled in source order, so calls
+//resolve exactly as in a serial parse
+static void ParseParallel(SourceBuffer &b, unsigned Jobs) {
+    std::vector<SourceChunk> chunks = SplitTopLevel(b.data(), b.size(), Jobs);
+    std::vector<ParseContext> ctxs(chunks.size(), ParseContext(true));
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < chunks.size(); i++) {
+        threads.emplace_back([&chunks, &ctxs, i]() {
+            SourceBuffer cb;
+            if (!cb.assign(chunks[i].Data, chunks[i].Size)) {
+                std::cerr << "Out of memory" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            ParseBuffer(cb, ctxs[i], chunks[i].Line, chunks[i].Column);
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    for (auto &ctx : ctxs) {
+        MergeParseStats(ctx);
+        ctx.flush();
+    }
+}
+
+static void ParseSource(SourceBuffer &b, unsigned Jobs) {
+    if (Jobs > 1) {
+        ParseParallel(b, Jobs);
+    }
+    else {
+        ParseContext ctx(false);
+        ParseBuffer(b, ctx, 1, 1);
+        MergeParseStats(ctx);
+    }
+}
+
+//parses every input in order, "-" stands for stdin
+static void ParseFiles(const std::vector<std::string> &Files, unsigned Jobs) {
+    for (auto &f : Files) {
+        SourceBuffer b;
+        if (!b.open(f)) {
+            std::cerr << "Cannot read " << f << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (TheDebugInfo)
+            TheDebugInfo->setFile(f);
+        if (TheEntryFilter)
+            TheEntryFilter->setFile(f);
+        ParseSource(b, Jobs);
+    }
+}
+
+//--specialize without =NODES
+static const size_t DefaultSpecializeBudget = 10000;
+
+/* Command line options, also the options of a --serve request. The
+   --stats, --mem-report and --stop-after flags go straight to the
+   globals they control. */
+struct Options {
+    Options()
+        : EmitC(false), EmitBytecode(false), Stream(false), IR(false), Debug(false), OptLevel(1), Jobs(1),
+          Workers(std::thread::hardware_concurrency()), SpecializeBudget(0)
+    {}
+    bool EmitC;
+    bool EmitBytecode;
+    //--run: the function to interpret
+    std::string Run;
+    bool Stream;
+    bool IR;
+    bool Debug;
+    int OptLevel;
+    unsigned Jobs;
+    std::string StatsFile;
+    std::string ServePath;
+    unsigned Workers;
+    //--entry: only what these reach is lowered
+    std::vector<std::string> Entries;
+    //--specialize: AST nodes the copies may add, 0 when off
+    size_t SpecializeBudget;
+    std::vector<std::string> Files;
+};
+
+//threads per core at most, more only add chunks and contention
+static const unsigned MaxThreadsPerCore = 4;
+
+//"-j4", "-j 4" or "--jobs=4", 0 means one per core; digits only, so a
+//negative or misspelt count is an error rather than a huge or partial one
+static bool ParseCount(const std::string &n, unsigned &Count) {
+    if (n.empty() || n.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    unsigned long Cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned long v = strtoul(n.c_str(), nullptr, 10);
+    Count = v == 0 ? Cores : std::min(v, MaxThreadsPerCore * Cores);
+    return true;
+}
+
+//false on an unknown or malformed argument
+static bool ParseArgs(const std::vector<std::string> &Args, Options &o) {
+    for (size_t i = 0; i < Args.size(); i++) {
+        const std::string &arg = Args[i];
+        if (arg == "--emit=c")
+            o.EmitC = true, o.EmitBytecode = false;
+        else if (arg == "--emit=bytecode")
+            o.EmitBytecode = true, o.EmitC = false;
+        else if (arg == "--emit=llvm")
+            o.EmitC = o.EmitBytecode = false;
+        else if (arg == "--run")
+            o.Run = "main";
+        else if (arg.compare(0, 6, "--run=") == 0 && arg.size() > 6)
+            o.Run = arg.substr(6);
+        else if (arg == "--stream")
+            o.Stream = true;
+        else if (arg == "--ir")
+            o.IR = true;
+        else if (arg == "-g")
+            o.Debug = true;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2")
+            o.OptLevel = arg[2] - '0';
+        else if (arg == "--stop-after=lex")
+            StopAfter = StopAfterLex;
+        else if (arg == "--stop-after=parse")
+            StopAfter = StopAfterParse;
+        else if (arg == "--stats=json")
+            TheStats.Enabled = true;
+        else if (arg == "--mem-report")
+            TheMemReport.Enabled = true;
+        else if (arg.compare(0, 13, "--stats-file=") == 0)
+            o.StatsFile = arg.substr(13);
+        else if (arg.compare(0, 2, "-j") == 0 || arg.compare(0, 7, "--jobs=") == 0) {
+            std::string n;
+            if (arg[1] == '-')
+                n = arg.substr(7);
+            else if (arg.size() > 2)
+                n = arg.substr(2);
+            else if (i + 1 < Args.size())
+                n = Args[++i];
+            if (!ParseCount(n, o.Jobs))
+                return false;
+        }
+        else if (arg == "--entry" && i + 1 < Args.size())
+            o.Entries.push_back(Args[++i]);
+        else if (arg.compare(0, 8, "--entry=") == 0 && arg.size() > 8)
+            o.Entries.push_back(arg.substr(8));
+        else if (arg == "--specialize")
+            o.SpecializeBudget = DefaultSpecializeBudget;
+        else if (arg.compare(0, 13, "--specialize=") == 0) {
+            o.SpecializeBudget = strtoul(arg.c_str() + 13, nullptr, 10);
+            if (o.SpecializeBudget == 0)
+                return false;
+        }
+        else if (arg == "--serve" && i + 1 < Args.size())
+            o.ServePath = Args[++i];
+        else if (arg.compare(0, 8, "--serve=") == 0)
+            o.ServePath = arg.substr(8);
+        else if (arg.compare(0, 10, "--workers=") == 0) {
+            if (!ParseCount(arg.substr(10), o.Workers))
+                return false;
+        }
+        else if (arg == "-" || arg[0] != '-')
+            o.Files.push_back(arg);
+        else
+            return false;
+    }
+    return true;
+}
+
+static void Usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " [--emit=llvm|c|bytecode] [--run[=FUNCTION]] [--entry NAME]... [--specialize[=NODES]]"
+              << " [--stream]"
+              << " [-O0|-O1|-O2] [-g] [-j N]"
+              << " [--stop-after=lex|parse] [--stats=json] [--stats-file=FILE]"
+              << " [--mem-report] [FILE...]\n"
+              << "       " << argv0 << " --ir [--stats=json] [--mem-report] FILE.ll|FILE.bc\n"
+              << "       " << argv0 << " --serve SOCKET [--workers=N]" << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+//--stats=json and --mem-report, once the output is written
+static void Report(const Options &o, double Start) {
+    if (TheStats.Enabled) {
+        TheStats.Phases["total"] = Stats::now() - Start;
+        if (o.StatsFile.empty()) {
+            TheStats.print(std::cerr);
+        }
+        else {
+            std::ofstream os(o.StatsFile);
+            TheStats.print(os);
+        }
+        //already reported as JSON, keep LLVM from printing its own table at exit
+        reportAndResetTimings(&nulls());
+    }
+    if (TheMemReport.Enabled)
+        TheMemReport.print(std::cerr);
+}
+
+//the files named in o, or Source when it is given
+static int Translate(const Options &o, SourceBuffer *Source) {
+    double Start = Stats::now();
+    auto Parse = [&]() {
+        TheMemReport.enter("parse");
+        EntryFilter f(o.Entries);
+        if (!o.Entries.empty())
+            TheEntryFilter = &f;
+        Specializer s(o.SpecializeBudget);
+        if (o.SpecializeBudget)
+            TheSpecializer = &s;
+        if (Source != nullptr)
+            ParseSource(*Source, o.Jobs);
+        else
+            ParseFiles(o.Files, o.Jobs);
+        if (TheEntryFilter) {
+            TheEntryFilter = nullptr;
+            f.finish();
+        }
+        TheSpecializer = nullptr;
+    };
+    if (o.EmitC) {
+        //no module, pass manager or target setup, only the AST walk
+        CEmitter e(std::cout);
+        e.prelude();
+        TheCEmitter = &e;
+        Parse();
+        TheCEmitter = nullptr;
+    }
+    else if (o.EmitBytecode || !o.Run.empty()) {
+        //no module, pass manager or target setup either
+        VMProgram p;
+        BytecodeCompiler c(p);
+        TheBytecode = &c;
+        Parse();
+        TheBytecode = nullptr;
+        if (StopAfter == StopNever) {
+            if (o.EmitBytecode)
+                p.print(std::cout);
+            if (!o.Run.empty()) {
+                PhaseTimer t("run");
+                TheMemReport.enter("run");
+                p.run(o.Run, std::cout);
+            }
+        }
+    }
+    else {
+        //per-pass timers of the legacy pass manager, must be set before it is built
+        TimePassesIsEnabled = TheStats.Enabled;
+        TheFpmAndModuleInit(o.OptLevel);
+
+        //--stream prints as it goes, the module never holds more than
+        //one body
+        IRStreamer s(outs());
+        bool Stream = o.Stream && StopAfter == StopNever;
+        if (Stream) {
+            TheStreamer = &s;
+            s.begin();
+        }
+        //after the streamed header, which must not include the compile
+        //unit, end() prints it with the other named metadata
+        std::unique_ptr<DebugInfo> d;
+        if (o.Debug) {
+            d.reset(new DebugInfo(*TheModule, Source ? "<request>" : o.Files[0], o.OptLevel > 0));
+            TheDebugInfo = d.get();
+        }
+
+        Parse();
+
+        if (d) {
+            d->finalize();
+            TheDebugInfo = nullptr;
+        }
+        if (Stream) {
+            TheMemReport.enter("print");
+            s.end();
+            TheStreamer = nullptr;
+        }
+        else if (StopAfter == StopNever) {
+            PhaseTimer t("print");
+            TheMemReport.enter("print");
+            TheModule->print(outs(), nullptr);
+        }
+        delete TheModule;
+        delete TheFPM;
+    }
+    Report(o, Start);
+    return 0;
+}
+
+//--ir: switches lowered in existing IR, text or bitcode, with the same
+//if/else chains and nothing else changed
+static int TranslateIR(const Options &o, SourceBuffer *Source) {
+    double Start = Stats::now();
+    if (o.Files.size() > 1) {
+        std::cerr << "--ir takes one input" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<Module> M;
+    SMDiagnostic Err;
+    {
+        PhaseTimer t("parse");
+        TheMemReport.enter("parse");
+        if (Source != nullptr)
+            M = parseIR(MemoryBufferRef(StringRef(Source->data(), Source->size()), "<request>"),
+                        Err, TheContext);
+        else
+            M = parseIRFile(o.Files.empty() ? "-" : o.Files[0], Err, TheContext);
+    }
+    if (!M) {
+        Err.print("swi2else", errs());
+        return EXIT_FAILURE;
+    }
+
+    {
+        PhaseTimer t("optimize");
+        TheMemReport.enter("optimize");
+        PassBuilder PB;
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+        ModulePassManager MPM;
+        MPM.addPass(createModuleToFunctionPassAdaptor(SwitchToIfElsePass()));
+        MPM.run(*M, MAM);
+    }
+    {
+        PhaseTimer t("verify");
+        if (verifyModule(*M, &errs()))
+            return EXIT_FAILURE;
+    }
+    if (StopAfter == StopNever) {
+        PhaseTimer t("print");
+        TheMemReport.enter("print");
+        M->print(outs(), nullptr);
+    }
+    M.reset();
+    Report(o, Start);
+    return 0;
+}
+
+static int Run(const Options &o, SourceBuffer *Source) {
+    return o.IR ? TranslateIR(o, Source) : Translate(o, Source);
+}
+
+//a --serve request: options as on the command line, except that the
+//input is the source sent along and nothing is written to files
+static int HandleRequest(const std::string &Line, const std::string &Src) {
+    std::istringstream is(Line);
+    std::vector<std::string> Args;
+    std::string a;
+    while (is >> a)
+        Args.push_back(a);
+    Options o;
+    if (!ParseArgs(Args, o) || !o.Files.empty() || !o.StatsFile.empty() || !o.ServePath.empty()) {
+        std::cerr << "Bad request options: " << Line << std::endl;
+        return EXIT_FAILURE;
+    }
+    SourceBuffer b;
+    if (!b.assign(Src.data(), Src.size())) {
+        std::cerr << "Out of memory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return Run(o, &b);
+}
+
+int main(int argc, char **argv) {
+
+    Options o;
+    if (!ParseArgs(std::vector<std::string>(argv + 1, argv + argc), o))
+        Usage(argv[0]);
+
+    if (!o.ServePath.empty()) {
+        //target, pass registry and the -O2 pipeline are set up once here,
+        //every worker starts from this state
+        TheFpmAndModuleInit(2);
+        delete TheFPM;
+        delete TheModule;
+        return Serve(o.ServePath, o.Workers, HandleRequest);
+    }
+
+    if (o.Files.empty())
+        o.Files.push_back("-");
+    return Run(o, nullptr);
+}
@@ -0,0 +1,330 @@
+#include <sstream>
+#include <iomanip>
+#include "ast.hpp"
+
+/* C backend: walks the AST and prints equivalent C source with every
+   switch rewritten as if/else. Nodes queue their output on the CEmitter
+   and FunctionAST::emitC prints it. Nothing here touches TheModule,
+   TheFPM or the IRBuilder, so it can run without the LLVM codegen
+   pipeline. */
+
+void yyerror(string s);
+
+extern LLVMContext TheContext;
+
+//deeper blocks print at this depth, so output stays linear in the input
+static const int MaxIndent = 32;
+
+ostream &CEmitter::line() {
+    for (int i = 0; i < std::min(Indent, MaxIndent); i++)
+        OS << "    ";
+    return OS;
+}
+
+const char *CTypeName(Type *t) {
+    if (t == Type::getInt32Ty(TheContext))
+        return "int";
+    if (t == Type::getDoubleTy(TheContext))
+        return "double";
+    if (t == Type::getVoidTy(TheContext))
+        return "void";
+    yyerror("Type has no C equivalent!");
+    return nullptr;
+}
+
+CEmitter &CEmitter::text(const string &s) {
+    Queue.push_back({ Item::Text, s, 0, nullptr });
+    return *this;
+}
+
+CEmitter &CEmitter::indented(const string &s) {
+    Queue.push_back({ Item::Line, s, 0, nullptr });
+    return *this;
+}
+
+CEmitter &CEmitter::indent(int d) {
+    Queue.push_back({ Item::Indent, string(), d, nullptr });
+    return *this;
+}
+
+CEmitter &CEmitter::node(const ExprAST *e) {
+    Queue.push_back({ Item::Node, string(), 0, e });
+    return *this;
+}
+
+CEmitter &CEmitter::stmt(const ExprAST *e) {
+    if (e->isStmt())
+        return node(e);
+    //a block inside a block, left by --specialize folding a switch
+    if (dynamic_cast<const BlockAST*>(e))
+        return indented("").braced(e);
+    return indented("").node(e).text(";\n");
+}
+
+CEmitter &CEmitter::braced(const ExprAST *e) {
+    return text("{\n").indent(1).node(e).indent(-1).indented("}\n");
+}
+
+//a node's items go on the stack last first, so they come off in order
+//and before anything queued by its parent after it
+void CEmitter::run() {
+    for (;;) {
+        while (!Queue.empty()) {
+            Stack.push_back(std::move(Queue.back()));
+            Queue.pop_back();
+        }
+        if (Stack.empty())
+            return;
+        Item I = std::move(Stack.back());
+        Stack.pop_back();
+        switch (I.Kind) {
+        case Item::Text:
+            OS << I.S;
+            break;
+        case Item::Line:
+            line() << I.S;
+            break;
+        case Item::Indent:
+            Indent += I.Delta;
+            break;
+        case Item::Node:
+            I.E->emitC(*this);
+            break;
+        }
+    }
+}
+
+void IntNumberExprAST::emitC(CEmitter &E) const {
+    E.text(to_string(Val));
+}
+
+void DoubleNumberExprAST::emitC(CEmitter &E) const {
+    //keep the literal a double even when it has no fractional part
+    ostringstream s;
+    s << setprecision(17) << Val;
+    string str = s.str();
+    if (str.find_first_of(".eEn") == string::npos)
+        str += ".0";
+    E.text(str);
+}
+
+void VariableExprAST::emitC(CEmitter &E) const {
+    E.text(Name);
+}
+
+/* The IR's arithmetic, which C's operators do not give: ints wrap and
+   divide and compare unsigned, a compare is 1.0 or 0.0 with unordered
+   doubles comparing true but for ne, and an int condition holds when it
+   is 0. _Generic picks the int or double helper without evaluating the
+   operand, so each is still evaluated once. */
+void CEmitter::prelude() {
+    static const char *Ops[][4] = {
+        { "add", "int", "(int)(x + y)", "a + b" },
+        { "sub", "int", "(int)(x - y)", "a - b" },
+        { "mul", "int", "(int)(x * y)", "a * b" },
+        { "div", "int", "(int)(x / y)", "a / b" },
+        { "lt", "double", "x < y", "!(a >= b)" },
+        { "gt", "double", "x > y", "!(a <= b)" },
+        { "eq", "double", "x == y", "!(a < b || a > b)" },
+        { "ne", "double", "x != y", "a != b" },
+        { "le", "double", "x <= y", "!(a > b)" },
+        { "ge", "double", "x >= y", "!(a < b)" },
+    };
+    for (auto &op : Ops) {
+        string N = string("_swi_") + op[0];
+        OS << "static inline " << op[1] << " " << N << "_i(int a, int b) { unsigned x = a, y = b; return "
+           << op[2] << "; }\n"
+           << "static inline double " << N << "_d(double a, double b) { return " << op[3] << "; }\n"
+           << "#define " << N << "(a, b) _Generic((a), int: " << N << "_i, default: " << N << "_d)(a, b)\n";
+    }
+    OS << "static inline int _swi_cond_i(int c) { return c == 0; }\n"
+       << "static inline int _swi_cond_d(double c) { return c < 0 || c > 0; }\n"
+       << "#define _swi_cond(c) _Generic((c), int: _swi_cond_i, default: _swi_cond_d)(c)\n\n";
+}
+
+void InnerExprAST::emitBinaryC(CEmitter &E, const char *Op) const {
+    E.text(string("_swi_") + Op + "(").node(Vec[0]).text(", ").node(Vec[1]).text(")");
+}
+
+void AddExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "add"); }
+void SubExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "sub"); }
+void MulExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "mul"); }
+void DivExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "div"); }
+void LtExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "lt"); }
+void GtExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "gt"); }
+void EqExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "eq"); }
+void NeExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "ne"); }
+void LeExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "le"); }
+void GeExprAST::emitC(CEmitter &E) const { emitBinaryC(E, "ge"); }
+
+void AssignExprAST::emitC(CEmitter &E) const {
+    E.text(VarName + " = ").node(Vec[0]);
+}
+
+void CallExprAST::emitC(CEmitter &E) const {
+    E.text(Callee + "(");
+    for (unsigned i = 0; i < Vec.size(); i++) {
+        if (i)
+            E.text(", ");
+        E.node(Vec[i]);
+    }
+    E.text(")");
+}
+
+void DeclExprAST::emitC(CEmitter &E) const {
+    //codegen zero-initialises declared variables, so does the C output
+    E.indented(string(CTypeName(Types)) + " ");
+    for (unsigned i = 0; i < Vec.size(); i++) {
+        if (i)
+            E.text(", ");
+        E.text(Vec[i] + " = 0");
+    }
+    E.text(";\n");
+}
+
+void DeclAndAssignExprAST::emitC(CEmitter &E) const {
+    E.indented(string(CTypeName(VarType)) + " " + VarName + " = ").node(Expr).text(";\n");
+}
+
+void BlockAST::emitC(CEmitter &E) const {
+    for (auto i : Vec)
+        E.stmt(i);
+}
+
+void BlockAST::emitCBody(CEmitter &E, Type *RetType) const {
+    if (Vec.empty())
+        return;
+    for (unsigned i = 0; i + 1 < Vec.size(); i++)
+        E.stmt(Vec[i]);
+
+    //value of a function body is the value of its last statement
+    ExprAST *Last = Vec.back();
+    if (RetType == Type::getVoidTy(TheContext)) {
+        E.stmt(Last);
+    }
+    else if (!Last->isStmt()) {
+        E.indented("return ").node(Last).text(";\n");
+    }
+    else {
+        E.stmt(Last);
+        auto DA = dynamic_cast<DeclAndAssignExprAST*>(Last);
+        E.indented("return " + (DA ? DA->getName() : "0") + ";\n");
+    }
+}
+
+void IfExprAST::emitC(CEmitter &E) const {
+    E.indented("if (_swi_cond(").node(Vec[0]).text(")) ").braced(Vec[1]);
+    if (Vec[2] != nullptr)
+        E.indented("else ").braced(Vec[2]);
+}
+
+void WhileExprAST::emitC(CEmitter &E) const {
+    E.indented("while (_swi_cond(").node(Vec[0]).text(")) ").braced(Vec[1]);
+}
+
+void ForExprAST::emitC(CEmitter &E) const {
+    //an outer block keeps a declaration in the init scoped to the loop
+    E.indented("{\n").indent(1);
+    if (Vec[0] != nullptr)
+        E.stmt(Vec[0]);
+    E.indented("for (; ");
+    if (Vec[1] != nullptr)
+        E.text("_swi_cond(").node(Vec[1]).text(")");
+    E.text("; ");
+    if (Vec[2] != nullptr)
+        E.node(Vec[2]);
+    E.text(") ").braced(Vec[3]);
+    E.indent(-1).indented("}\n");
+}
+
+void SwitchExprAST::emitC(CEmitter &E) const {
+    int num_of_default_cases = 0;
+    bool fallthrough = false;
+    for (unsigned i = 0; i < Cases.size(); i++) {
+        bool last = i + 1 == Cases.size();
+        if (Cases[i].first.first == nullptr)
+            num_of_default_cases++;
+        //default has no break form, so it only falls out of the switch when last
+        if (!last && !Cases[i].second)
+            fallthrough = true;
+    }
+    if (num_of_default_cases > 1)
+        yyerror("Too much default cases! Only one allowed");
+
+    string Id = to_string(E.Counter++);
+    string Sel = "_swi_v" + Id;
+
+    E.indented("{\n").indent(1);
+    E.indented("int " + Sel + " = ").node(Condition).text(";\n");
+
+    if (!fallthrough) {
+        //every case breaks: a plain if/else chain, default goes last
+        const ExprAST *Default = nullptr;
+        bool first = true;
+        for (auto &c : Cases) {
+            if (c.first.first == nullptr) {
+                Default = c.first.second;
+                continue;
+            }
+            E.indented((first ? "if (" : "else if (") + Sel + " == ");
+            E.node(c.first.first).text(") ").braced(c.first.second);
+            first = false;
+        }
+        if (Default != nullptr)
+            E.indented(first ? "" : "else ").braced(Default);
+    }
+    else {
+        //fallthrough: state 0 while searching, 1 once a case matched, 2 after break
+        string St = "_swi_s" + Id;
+        E.indented("int " + St + " = 0;\n");
+        for (auto &c : Cases) {
+            E.indented("if (" + St + " == 1 || (" + St + " == 0");
+            if (c.first.first != nullptr) {
+                E.text(" && " + Sel + " == ").node(c.first.first);
+            }
+            else {
+                //default matches only when no case label does
+                bool first = true;
+                for (auto &o : Cases) {
+                    if (o.first.first == nullptr)
+                        continue;
+                    E.text((first ? " && !(" : " || ") + Sel + " == ").node(o.first.first);
+                    first = false;
+                }
+                if (!first)
+                    E.text(")");
+            }
+            E.text(")) {\n").indent(1);
+            E.indented(St + " = 1;\n").node(c.first.second);
+            if (c.second)
+                E.indented(St + " = 2;\n");
+            E.indent(-1).indented("}\n");
+        }
+    }
+
+    E.indent(-1).indented("}\n");
+}
+
+void PrototypeAST::emitC(CEmitter &E) const {
+    E.line() << CTypeName(Type) << " " << Name << "(";
+    for (unsigned i = 0; i < Args.size(); i++) {
+        if (i)
+            E.OS << ", ";
+        E.OS << CTypeName(Args[i]->type) << " " << Args[i]->VarName;
+    }
+    E.OS << ")";
+}
+
+void FunctionAST::emitC(CEmitter &E) const {
+    Proto->emitC(E);
+    E.OS << " {\n";
+    E.Indent++;
+    auto B = dynamic_cast<BlockAST*>(Body);
+    if (B != nullptr)
+        B->emitCBody(E, Proto->getType());
+    else
+        E.stmt(Body);
+    E.run();
+    E.Indent--;
+    E.line() << "}\n\n";
+}
@@ -0,0 +1,345 @@
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ast.hpp"
+#include "input.hpp"
+#include "parser.tab.hpp"
+
+/* Hand-written replacement for the flex scanner in lexer.lex, built with
+   "make LEXER=fast". Produces the same tokens and locations through the
+   same pure yylex(YYSTYPE*, YYLTYPE*, scanner) and LexBegin()/LexEnd()
+   interface. Runs of
+   whitespace, comment bodies, identifiers and digits are measured a
+   vector at a time, keywords are found with a perfect hash and numbers
+   are converted with std::from_chars. */
+
+namespace {
+
+struct FastLexer {
+    const char *Cur;
+    const char *End;
+    int Line;
+    //columns are counted from here, the byte after the last newline
+    const char *LineStart;
+};
+
+struct Keyword {
+    const char *Name;
+    unsigned Len;
+    int Token;
+};
+
+constexpr Keyword Keywords[] = {
+    { "break", 5, break_token },
+    { "void", 4, void_token },
+    { "int", 3, int_token },
+    { "double", 6, double_token },
+    { "char", 4, char_token },
+    { "if", 2, if_token },
+    { "else", 4, else_token },
+    { "switch", 6, switch_token },
+    { "case", 4, case_token },
+    { "default", 7, default_token },
+    { "for", 3, for_token },
+    { "while", 5, while_token },
+};
+constexpr unsigned NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+constexpr unsigned KeywordSlots = 32;
+
+constexpr unsigned KeywordHash(const char *s, unsigned len) {
+    return ((unsigned char)s[0] + 7u * (unsigned char)s[len - 1] + len) & (KeywordSlots - 1);
+}
+
+struct KeywordTable {
+    signed char Slot[KeywordSlots];
+};
+
+constexpr KeywordTable MakeKeywordTable() {
+    KeywordTable t{};
+    for (unsigned i = 0; i < KeywordSlots; i++)
+        t.Slot[i] = -1;
+    for (unsigned i = 0; i < NumKeywords; i++)
+        t.Slot[KeywordHash(Keywords[i].Name, Keywords[i].Len)] = i;
+    return t;
+}
+
+constexpr bool KeywordHashIsPerfect() {
+    bool used[KeywordSlots] = {};
+    for (unsigned i = 0; i < NumKeywords; i++) {
+        unsigned h = KeywordHash(Keywords[i].Name, Keywords[i].Len);
+        if (used[h])
+            return false;
+        used[h] = true;
+    }
+    return true;
+}
+
+static_assert(KeywordHashIsPerfect(), "keyword hash has collisions, pick new constants");
+
+constexpr KeywordTable KeywordIndex = MakeKeywordTable();
+
+} // namespace
+
+static int LookupKeyword(const char *s, unsigned len) {
+    if (len < 2 || len > 7)
+        return -1;
+    int i = KeywordIndex.Slot[KeywordHash(s, len)];
+    if (i < 0 || Keywords[i].Len != len || memcmp(Keywords[i].Name, s, len) != 0)
+        return -1;
+    return Keywords[i].Token;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#if defined(__AVX2__)
+typedef __m256i Vec;
+static const unsigned VecWidth = 32;
+static const uint32_t FullMask = 0xFFFFFFFFu;
+static inline Vec Load(const char *p) { return _mm256_loadu_si256((const Vec*)p); }
+static inline Vec Splat(char c) { return _mm256_set1_epi8(c); }
+static inline Vec Eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline Vec Gt(Vec a, Vec b) { return _mm256_cmpgt_epi8(a, b); }
+static inline Vec Or(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+static inline Vec And(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+static inline uint32_t Mask(Vec v) { return (uint32_t)_mm256_movemask_epi8(v); }
+#else
+typedef __m128i Vec;
+static const unsigned VecWidth = 16;
+static const uint32_t FullMask = 0xFFFFu;
+static inline Vec Load(const char *p) { return _mm_loadu_si128((const Vec*)p); }
+static inline Vec Splat(char c) { return _mm_set1_epi8(c); }
+static inline Vec Eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+static inline Vec Gt(Vec a, Vec b) { return _mm_cmpgt_epi8(a, b); }
+static inline Vec Or(Vec a, Vec b) { return _mm_or_si128(a, b); }
+static inline Vec And(Vec a, Vec b) { return _mm_and_si128(a, b); }
+static inline uint32_t Mask(Vec v) { return (uint32_t)_mm_movemask_epi8(v); }
+#endif
+
+//signed compares, so bytes >= 0x80 never fall in an ASCII range
+static inline Vec InRange(Vec v, char lo, char hi) {
+    return And(Gt(v, Splat(lo - 1)), Gt(Splat(hi + 1), v));
+}
+
+static inline void CountLines(const char *p, uint32_t lines, int &line, const char *&lineStart) {
+    if (lines) {
+        line += __builtin_popcount(lines);
+        lineStart = p + (31 - __builtin_clz(lines)) + 1;
+    }
+}
+
+//loads may run past the end of the input, SourcePadding keeps them inside the buffer
+static const char *SkipSpace(const char *p, int &line, const char *&lineStart) {
+    for (;;) {
+        Vec v = Load(p);
+        Vec nl = Eq(v, Splat('\n'));
+        Vec ws = Or(nl, Or(Eq(v, Splat(' ')), Eq(v, Splat('\t'))));
+        uint32_t stop = ~Mask(ws) & FullMask;
+        uint32_t lines = Mask(nl);
+        if (stop) {
+            unsigned n = __builtin_ctz(stop);
+            CountLines(p, lines & ((1u << n) - 1), line, lineStart);
+            return p + n;
+        }
+        CountLines(p, lines, line, lineStart);
+        p += VecWidth;
+    }
+}
+
+static const char *SkipIdent(const char *p) {
+    for (;;) {
+        Vec v = Load(p);
+        Vec id = Or(Or(InRange(v, 'a', 'z'), InRange(v, 'A', 'Z')),
+                    Or(InRange(v, '0', '9'), Eq(v, Splat('_'))));
+        uint32_t stop = ~Mask(id) & FullMask;
+        if (stop)
+            return p + __builtin_ctz(stop);
+        p += VecWidth;
+    }
+}
+
+static const char *SkipDigits(const char *p) {
+    for (;;) {
+        uint32_t stop = ~Mask(InRange(Load(p), '0', '9')) & FullMask;
+        if (stop)
+            return p + __builtin_ctz(stop);
+        p += VecWidth;
+    }
+}
+
+//returns the '\n' or NUL that ends the line
+static const char *SkipLine(const char *p) {
+    for (;;) {
+        Vec v = Load(p);
+        uint32_t stop = Mask(Or(Eq(v, Splat('\n')), Eq(v, Splat('\0'))));
+        if (stop)
+            return p + __builtin_ctz(stop);
+        p += VecWidth;
+    }
+}
+
+#else
+
+static const char *SkipSpace(const char *p, int &line, const char *&lineStart) {
+    for (; *p == ' ' || *p == '\t' || *p == '\n'; p++) {
+        if (*p == '\n') {
+            line++;
+            lineStart = p + 1;
+        }
+    }
+    return p;
+}
+
+static const char *SkipIdent(const char *p) {
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
+        p++;
+    return p;
+}
+
+static const char *SkipDigits(const char *p) {
+    while (*p >= '0' && *p <= '9')
+        p++;
+    return p;
+}
+
+static const char *SkipLine(const char *p) {
+    while (*p != '\n' && *p != '\0')
+        p++;
+    return p;
+}
+
+#endif
+
+static inline bool IsAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+//flex picks the longest match, so <...> and "..." run to the last delimiter on the line
+static const char *LastOnLine(const char *p, char c) {
+    const char *last = nullptr;
+    const char *e = SkipLine(p);
+    for (const char *q = p; q < e; q++)
+        if (*q == c)
+            last = q;
+    return last;
+}
+
+static int TokenFrom(FastLexer *L, YYSTYPE *lval, const char *s, const char *e, int token) {
+    lval->tok = { s, (size_t)(e - s) };
+    L->Cur = e;
+    return token;
+}
+
+int yylex(YYSTYPE *lval, YYLTYPE *lloc, void *scanner) {
+    FastLexer *L = (FastLexer*)scanner;
+    const char *&Cur = L->Cur;
+    for (;;) {
+        const char *s = Cur = SkipSpace(Cur, L->Line, L->LineStart);
+        char c = *s;
+        //as in lexer.lex, only the start of the token
+        lloc->first_line = lloc->last_line = L->Line;
+        lloc->first_column = lloc->last_column = s - L->LineStart + 1;
+
+        if (IsAlpha(c)) {
+            const char *e = SkipIdent(s + 1);
+            int kw = LookupKeyword(s, e - s);
+            if (kw >= 0) {
+                Cur = e;
+                return kw;
+            }
+            return TokenFrom(L, lval, s, e, id_token);
+        }
+
+        if (IsDigit(c)) {
+            const char *e = SkipDigits(s + 1);
+            if (*e == '.' && IsDigit(e[1])) {
+                e = SkipDigits(e + 2);
+                //out of range: whatever atof gives, as with flex
+                if (std::from_chars(s, e, lval->d).ec != std::errc())
+                    lval->d = atof(std::string(s, e).c_str());
+                Cur = e;
+                return d_num_token;
+            }
+            //likewise atoi, which wraps rather than failing
+            if (std::from_chars(s, e, lval->i).ec != std::errc())
+                lval->i = atoi(std::string(s, e).c_str());
+            Cur = e;
+            return i_num_token;
+        }
+
+        switch (c) {
+        case '\0':
+            if (s >= L->End)
+                return 0;
+            break;
+        case '/':
+            if (s[1] == '/') {
+                Cur = SkipLine(s + 2);
+                continue;
+            }
+            Cur = s + 1;
+            return c;
+        case '#':
+            if (strncmp(s, "#include", 8) == 0) {
+                Cur = s + 8;
+                return include_token;
+            }
+            break;
+        case '<': {
+            const char *q = LastOnLine(s + 1, '>');
+            if (q != nullptr)
+                return TokenFrom(L, lval, s, q + 1, ppd_token);
+            Cur = s + 1;
+            if (*Cur == '=') {
+                Cur++;
+                return le_token;
+            }
+            return c;
+        }
+        case '"': {
+            const char *q = LastOnLine(s + 1, '"');
+            if (q != nullptr)
+                return TokenFrom(L, lval, s, q + 1, string_token);
+            break;
+        }
+        case '=':
+        case '!':
+        case '>':
+            Cur = s + 1;
+            if (*Cur == '=') {
+                Cur++;
+                return c == '=' ? eq_token : c == '!' ? ne_token : ge_token;
+            }
+            return c;
+        case '@': case ',': case '+': case '*': case '(': case ')':
+        case ';': case ':': case '$': case '|': case '\'': case '[':
+        case ']': case '{': case '}': case '-':
+            Cur = s + 1;
+            return c;
+        }
+
+        std::cerr << "Lex err: " << c << std::endl;
+        Cur = s + 1;
+    }
+}
+
+void *LexBegin(SourceBuffer &b, int line, int col) {
+    return new FastLexer{ b.data(), b.data() + b.size(), line, b.data() - (col - 1) };
+}
+
+void LexEnd(void *scanner) {
+    delete (FastLexer*)scanner;
+}
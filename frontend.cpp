@@ -0,0 +1,270 @@
+#include <set>
+#include "frontend.hpp"
+#include "stats.hpp"
+#include "memreport.hpp"
+#include "stream.hpp"
+#include "bytecode.hpp"
+#include "debuginfo.hpp"
+#include "specialize.hpp"
+
+extern CEmitter* TheCEmitter;
+
+EntryFilter *TheEntryFilter = nullptr;
+
+void yyerror(string s);
+
+static void Measure(TopLevelItem &item) {
+    if (item.Func)
+        item.Bytes = TheMemReport.addFunction(item.Func);
+    else if (item.Proto)
+        item.Bytes = TheMemReport.addPrototype(item.Proto);
+}
+
+static void HandleFunction(FunctionAST *Func) {
+    MemPhase m(TheCEmitter ? "emit_c" : TheBytecode ? "bytecode" : "codegen");
+    if (TheStats.Enabled) {
+        TheStats.countNodes(Func);
+        TheStats.FunctionsEmitted++;
+    }
+    if (TheCEmitter) {
+        PhaseTimer t("emit_c");
+        Func->emitC(*TheCEmitter);
+    }
+    else if (TheBytecode) {
+        PhaseTimer t("bytecode");
+        TheBytecode->function(Func);
+    }
+    else if (TheStreamer) {
+        TheStreamer->define(Func->getName());
+        if (Function *F = Func->codegen())
+            TheStreamer->function(F);
+    }
+    else
+        Func->codegen();
+    delete Func;
+}
+
+static void HandleTopLevel(const TopLevelItem &item) {
+    if (StopAfter == StopAfterParse) {
+        delete item.Func;
+        delete item.Proto;
+    }
+    else if (item.Func) {
+        //the copies the function's calls were redirected to come first
+        if (TheSpecializer)
+            for (FunctionAST *Copy : TheSpecializer->function(item.Func))
+                HandleFunction(Copy);
+        HandleFunction(item.Func);
+    }
+    else if (item.Proto) {
+        if (TheStats.Enabled)
+            TheStats.Nodes[typeid(PrototypeAST)]++;
+        if (TheCEmitter) {
+            item.Proto->emitC(*TheCEmitter);
+            TheCEmitter->OS << ";\n\n";
+        }
+        else if (TheBytecode)
+            TheBytecode->declare(item.Proto);
+        else
+            item.Proto->codegen();
+        delete item.Proto;
+    }
+    else if (TheCEmitter) {
+        TheCEmitter->OS << "#include " << item.Include << "\n";
+    }
+    if (TheMemReport.Enabled)
+        TheMemReport.release(item.Bytes);
+}
+
+//the names each function's body calls, in no particular order
+static void Callees(const FunctionAST *f, std::vector<std::string> &out) {
+    std::vector<const ExprAST*> work;
+    f->children(work);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        if (auto *c = dynamic_cast<const CallExprAST*>(e))
+            out.push_back(c->getCallee());
+        e->children(work);
+    }
+}
+
+void EntryFilter::finish() {
+    std::set<std::string> Reached;
+    {
+        PhaseTimer t("callgraph");
+        //a name may be defined more than once, codegen reports that
+        std::multimap<std::string, const FunctionAST*> Defs;
+        std::set<std::string> Declared;
+        for (auto &item : Items) {
+            if (item.Func)
+                Defs.insert({ item.Func->getName(), item.Func });
+            else if (item.Proto)
+                Declared.insert(item.Proto->getName());
+        }
+        std::vector<std::string> Work;
+        for (auto &e : Entries) {
+            if (!Defs.count(e) && !Declared.count(e))
+                yyerror("Entry point " + e + " is not declared");
+            if (Reached.insert(e).second)
+                Work.push_back(e);
+        }
+        std::vector<std::string> Calls;
+        while (!Work.empty()) {
+            std::string Name = Work.back();
+            Work.pop_back();
+            auto Range = Defs.equal_range(Name);
+            for (auto It = Range.first; It != Range.second; ++It)
+                Callees(It->second, Calls);
+            for (auto &c : Calls)
+                if (Reached.insert(c).second)
+                    Work.push_back(c);
+            Calls.clear();
+        }
+    }
+
+    size_t NextFile = 0;
+    for (size_t i = 0; i < Items.size(); i++) {
+        TopLevelItem &item = Items[i];
+        for (; NextFile < Files.size() && Files[NextFile].first == i; NextFile++)
+            if (TheDebugInfo)
+                TheDebugInfo->setFile(Files[NextFile].second);
+        if (item.Func && !Reached.count(item.Func->getName())) {
+            if (TheStats.Enabled)
+                TheStats.FunctionsSkipped++;
+            delete item.Func;
+        }
+        else if (item.Proto && !Reached.count(item.Proto->getName())) {
+            delete item.Proto;
+        }
+        else {
+            HandleTopLevel(item);
+            continue;
+        }
+        if (TheMemReport.Enabled)
+            TheMemReport.release(item.Bytes);
+    }
+    Items.clear();
+    Files.clear();
+}
+
+void ParseContext::add(TopLevelItem item) {
+    if (Defer) {
+        Items.push_back(item);
+        return;
+    }
+    if (TheMemReport.Enabled)
+        Measure(item);
+    if (TheEntryFilter)
+        TheEntryFilter->add(item);
+    else if (TheStats.Enabled) {
+        double start = Stats::now();
+        HandleTopLevel(item);
+        HandleTime += Stats::now() - start;
+    }
+    else {
+        HandleTopLevel(item);
+    }
+}
+
+void ParseContext::addFunction(FunctionAST *f) {
+    add({ f, nullptr, "", 0 });
+}
+
+void ParseContext::addPrototype(PrototypeAST *p) {
+    add({ nullptr, p, "", 0 });
+}
+
+void ParseContext::addInclude(const std::string &s) {
+    add({ nullptr, nullptr, s, 0 });
+}
+
+//chunks are parsed on other threads, their trees are measured here, all
+//at once, because they are all alive until handled
+void ParseContext::flush() {
+    if (TheMemReport.Enabled)
+        for (auto &item : Items)
+            Measure(item);
+    for (auto &item : Items) {
+        if (TheEntryFilter)
+            TheEntryFilter->add(item);
+        else
+            HandleTopLevel(item);
+    }
+    Items.clear();
+}
+
+std::vector<TopLevelItem> ParseContext::take() {
+    std::vector<TopLevelItem> items;
+    items.swap(Items);
+    return items;
+}
+
+//index just past the end of the line, mirrors the lexer's single-line tokens
+static size_t LineEnd(const char *data, size_t size, size_t i) {
+    while (i < size && data[i] != '\n')
+        i++;
+    return i;
+}
+
+std::vector<SourceChunk> SplitTopLevel(const char *data, size_t size, unsigned parts) {
+    std::vector<SourceChunk> chunks;
+    size_t target = parts ? size / parts : size;
+    size_t start = 0;
+    int startLine = 1;
+    int startCol = 1;
+    int line = 1;
+    size_t lineStart = 0;
+    int depth = 0;
+    bool pending = false;
+
+    for (size_t i = 0; i < size; i++) {
+        char c = data[i];
+        bool boundary = false;
+        if (c == '\n') {
+            line++;
+            lineStart = i + 1;
+        }
+        else if (c == '/' && i + 1 < size && data[i + 1] == '/') {
+            i = LineEnd(data, size, i) - 1;
+        }
+        else if (c == '"') {
+            //a string token runs to the last quote on its line
+            size_t e = LineEnd(data, size, i);
+            for (size_t j = e; j > i + 1; j--) {
+                if (data[j - 1] == '"') {
+                    i = j - 1;
+                    break;
+                }
+            }
+        }
+        else if (c == '{') {
+            depth++;
+        }
+        else if (c == '}') {
+            depth--;
+            boundary = depth == 0;
+        }
+        else if (c == ';') {
+            boundary = depth == 0;
+        }
+
+        if (!boundary)
+            continue;
+        pending = true;
+        if (i + 1 - start >= target && chunks.size() + 1 < parts) {
+            chunks.push_back({ data + start, i + 1 - start, startLine, startCol });
+            start = i + 1;
+            startLine = line;
+            startCol = (int)(start - lineStart) + 1;
+            pending = false;
+        }
+    }
+
+    //a tail without declarations (comments, blank lines) would not parse on its own
+    if (!pending && !chunks.empty())
+        chunks.back().Size = size - (chunks.back().Data - data);
+    else
+        chunks.push_back({ data + start, size - start, startLine, startCol });
+    return chunks;
+}
@@ -0,0 +1,79 @@
+#ifndef __FRONTEND_HPP__
+#define __FRONTEND_HPP__ 1
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "ast.hpp"
+
+/* One top-level declaration as handed over by the parser. Exactly one of
+   Func, Proto or Include is set. */
+struct TopLevelItem {
+    FunctionAST *Func;
+    PrototypeAST *Proto;
+    std::string Include;
+    //held by the tree, set when --mem-report walks it
+    size_t Bytes;
+};
+
+/* Receives what the parser produces. A serial parse handles every item as
+   soon as it is reduced; a parse of one chunk of a split file defers them
+   so the driver can handle all chunks in source order afterwards. */
+class ParseContext {
+public:
+    ParseContext(bool defer)
+        : Tokens(0), LexTime(0), ParseTime(0), HandleTime(0), Defer(defer)
+    {}
+    void addFunction(FunctionAST *f);
+    void addPrototype(PrototypeAST *p);
+    void addInclude(const std::string &s);
+    void flush();
+    //hands the deferred items over instead of handling them
+    std::vector<TopLevelItem> take();
+
+    //--stats, filled in only when TheStats.Enabled
+    uint64_t Tokens;
+    double LexTime;
+    double ParseTime;
+    double HandleTime;
+private:
+    void add(TopLevelItem item);
+    bool Defer;
+    std::vector<TopLevelItem> Items;
+};
+
+/* --entry: the items are held until the whole input is parsed, then
+   only the functions reachable through calls from the entry points are
+   handed on, in source order, and the others deleted without being
+   lowered. Prototypes follow the same rule, includes are kept. */
+class EntryFilter {
+public:
+    EntryFilter(const std::vector<std::string> &entries) : Entries(entries) {}
+    void add(const TopLevelItem &item) { Items.push_back(item); }
+    //the items added from now on come from Path, for -g
+    void setFile(const std::string &Path) { Files.push_back({ Items.size(), Path }); }
+    void finish();
+private:
+    std::vector<std::string> Entries;
+    std::vector<TopLevelItem> Items;
+    std::vector<std::pair<size_t, std::string>> Files;
+};
+
+//set while --entry is on
+extern EntryFilter *TheEntryFilter;
+
+/* --stop-after: end the pipeline early, used to time the phases one by one. */
+enum StopPhase { StopNever, StopAfterLex, StopAfterParse };
+extern StopPhase StopAfter;
+
+/* A run of whole top-level declarations inside an input buffer. */
+struct SourceChunk {
+    const char *Data;
+    size_t Size;
+    int Line;
+    int Column;
+};
+
+std::vector<SourceChunk> SplitTopLevel(const char *data, size_t size, unsigned parts);
+
+#endif
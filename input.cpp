@@ -0,0 +1,81 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "input.hpp"
+
+SourceBuffer::~SourceBuffer() {
+    if (MapLen)
+        munmap(Data, MapLen);
+    else
+        free(Data);
+}
+
+bool SourceBuffer::open(const std::string &path) {
+    if (path == "-")
+        return readStdin();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    Size = st.st_size;
+    MapLen = Size + SourcePadding;
+
+    //zeroed anonymous mapping first, the file goes over its beginning, so the
+    //padding is zero even when the file ends exactly on a page boundary;
+    //private and writable because flex NUL-terminates yytext in place
+    void *p = mmap(nullptr, MapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        MapLen = 0;
+        return false;
+    }
+    if (Size && mmap(p, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(p, MapLen);
+        close(fd);
+        MapLen = 0;
+        return false;
+    }
+    close(fd);
+    madvise(p, MapLen, MADV_SEQUENTIAL);
+    Data = (char*)p;
+    return true;
+}
+
+bool SourceBuffer::assign(const char *data, size_t size) {
+    Data = (char*)malloc(size + SourcePadding);
+    if (Data == nullptr)
+        return false;
+    memcpy(Data, data, size);
+    memset(Data + size, 0, SourcePadding);
+    Size = size;
+    return true;
+}
+
+bool SourceBuffer::readStdin() {
+    size_t cap = 1 << 16;
+    Data = (char*)malloc(cap);
+    if (Data == nullptr)
+        return false;
+    size_t n;
+    while ((n = fread(Data + Size, 1, cap - Size - SourcePadding, stdin)) > 0) {
+        Size += n;
+        if (cap - Size - SourcePadding == 0) {
+            cap *= 2;
+            char *tmp = (char*)realloc(Data, cap);
+            if (tmp == nullptr)
+                return false;
+            Data = tmp;
+        }
+    }
+    memset(Data + Size, 0, SourcePadding);
+    return !ferror(stdin);
+}
@@ -0,0 +1,47 @@
+#ifndef __INPUT_HPP__
+#define __INPUT_HPP__ 1
+
+#include <string>
+#include <cstddef>
+
+/* Token text handed from the lexer to the parser. Points straight into
+   the SourceBuffer being scanned, so it is only valid while that buffer
+   is alive. Kept a plain struct so it can live in Bison's %union. */
+struct TokenText {
+    const char *Data;
+    size_t Len;
+    std::string str() const { return std::string(Data, Len); }
+};
+
+/* Whole input file in memory, followed by SourcePadding NUL bytes: flex
+   needs two at the end of a buffer given to yy_scan_buffer, the fast
+   lexer loads whole vectors and may read past the last character. Files
+   are mmap-ed, stdin is read into a heap buffer. */
+const size_t SourcePadding = 64;
+
+class SourceBuffer {
+public:
+    SourceBuffer()
+        : Data(nullptr), Size(0), MapLen(0)
+    {}
+    ~SourceBuffer();
+    bool open(const std::string &path);
+    bool assign(const char *data, size_t size);
+    char *data() const { return Data; }
+    size_t size() const { return Size; }
+private:
+    SourceBuffer(const SourceBuffer&);
+    SourceBuffer& operator=(const SourceBuffer&);
+    bool readStdin();
+    char *Data;
+    size_t Size;
+    size_t MapLen;
+};
+
+//defined in lexer.lex (or fastlex.cpp), a scanner per buffer so
+//several buffers can be lexed at once on different threads; line and
+//col are the position of the buffer's first byte in the file
+void *LexBegin(SourceBuffer &b, int line = 1, int col = 1);
+void LexEnd(void *scanner);
+
+#endif
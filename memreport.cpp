@@ -0,0 +1,246 @@
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include "ast.hpp"
+#include "stats.hpp"
+#include "memreport.hpp"
+#include "llvm/Support/ErrorHandling.h"
+
+MemReport TheMemReport;
+
+//bytes handed out by operator new and not yet deleted, counted only
+//while the report is enabled; AST nodes, LLVM values, blocks and names
+//all come from here
+static std::atomic<long long> NewBytes(0);
+
+void *operator new(size_t n) {
+    void *p = malloc(n ? n : 1);
+    if (p == nullptr)
+        report_bad_alloc_error("Allocation failed");
+    if (TheMemReport.Enabled)
+        NewBytes.fetch_add(malloc_usable_size(p), std::memory_order_relaxed);
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    if (p != nullptr && TheMemReport.Enabled)
+        NewBytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+    free(p);
+}
+
+//the sized form C++14 calls when the size is known, same accounting
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+size_t MemReport::heapBytes(const void *p) {
+    return p ? malloc_usable_size(const_cast<void*>(p)) : 0;
+}
+
+//short strings live inside the object, only longer ones own a heap block
+size_t MemReport::stringBytes(const std::string &s) {
+    const char *d = s.data();
+    const char *o = (const char*)&s;
+    if (d >= o && d < o + sizeof(s))
+        return 0;
+    return heapBytes(d);
+}
+
+//mallinfo would be exact, but it walks every free chunk of every arena,
+//which is far too slow to call around each function
+size_t MemReport::heapInUse() {
+    long long n = NewBytes.load(std::memory_order_relaxed);
+    return n > 0 ? n : 0;
+}
+
+size_t MemReport::currentRSS() {
+    size_t pages = 0, resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t MaxRSS() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (size_t)ru.ru_maxrss * 1024;
+}
+
+void MemReport::addNode(std::type_index t, size_t bytes) {
+    ClassMemory &c = Classes[t];
+    c.Nodes++;
+    c.Bytes += bytes;
+}
+
+size_t MemReport::walkPrototype(const PrototypeAST *p) {
+    size_t buffers = 0, strings = 0;
+    p->ownedBytes(buffers, strings);
+    size_t bytes = heapBytes(p) + buffers;
+    addNode(typeid(PrototypeAST), bytes);
+    TokenStrings += strings;
+    return bytes + strings;
+}
+
+size_t MemReport::addPrototype(const PrototypeAST *p) {
+    size_t total = walkPrototype(p);
+    LiveAST += total;
+    PeakLiveAST = std::max(PeakLiveAST, LiveAST);
+    return total;
+}
+
+size_t MemReport::addFunction(const FunctionAST *f) {
+    size_t total = walkPrototype(f->getProto()) + heapBytes(f);
+    addNode(typeid(FunctionAST), heapBytes(f));
+    std::vector<const ExprAST*> work;
+    f->children(work);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        size_t buffers = 0, strings = 0;
+        e->ownedBytes(buffers, strings);
+        //the block starts at the most derived object
+        size_t bytes = heapBytes(dynamic_cast<const void*>(e)) + buffers;
+        addNode(typeid(*e), bytes);
+        TokenStrings += strings;
+        total += bytes + strings;
+        e->children(work);
+    }
+    LiveAST += total;
+    PeakLiveAST = std::max(PeakLiveAST, LiveAST);
+    return total;
+}
+
+//std::map nodes are not reachable from outside, so they are estimated:
+//four tree links and the entry, plus the name when it does not fit inline
+void MemReport::symbolTables(const SymbolTable &inner, const std::vector<SymbolTable> &outer) {
+    const size_t node = 4 * sizeof(void*) + sizeof(SymbolTable::value_type);
+    size_t entries = 0, bytes = vectorBytes(outer);
+    for (size_t i = 0; i <= outer.size(); i++) {
+        const SymbolTable &t = i < outer.size() ? outer[i] : inner;
+        entries += t.size();
+        for (auto &v : t)
+            bytes += node + stringBytes(v.first);
+    }
+    if (bytes > PeakSymbolBytes) {
+        PeakSymbolBytes = bytes;
+        PeakSymbols = entries;
+        PeakScopes = outer.size() + 1;
+    }
+}
+
+void MemReport::sample(const char *phase, size_t rss, size_t heap) {
+    if (PeakRSS.find(phase) == PeakRSS.end())
+        PhaseOrder.push_back(phase);
+    size_t &peak = PeakRSS[phase];
+    peak = std::max(peak, rss);
+    size_t &peakHeap = PeakHeap[phase];
+    peakHeap = std::max(peakHeap, heap);
+}
+
+//the RSS high-water mark only moves up, so whatever it gained since the
+//last switch was reached inside the phase being left
+const char *MemReport::enter(const char *phase) {
+    if (!Enabled)
+        return Phase;
+    size_t rss = currentRSS();
+    size_t max = MaxRSS();
+    size_t heap = heapInUse();
+    sample(Phase, std::max(rss, max > LastMaxRSS ? max : 0), heap);
+    sample(phase, rss, heap);
+    LastMaxRSS = max;
+    const char *prev = Phase;
+    Phase = phase;
+    return prev;
+}
+
+static std::string Size(size_t bytes) {
+    char buf[32];
+    if (bytes < 10 * 1024)
+        snprintf(buf, sizeof(buf), "%zu B", bytes);
+    else if (bytes < 10 * 1024 * 1024)
+        snprintf(buf, sizeof(buf), "%.1f KiB", bytes / 1024.0);
+    else
+        snprintf(buf, sizeof(buf), "%.1f MiB", bytes / (1024.0 * 1024.0));
+    return buf;
+}
+
+void MemReport::print(std::ostream &os) {
+    size_t max = MaxRSS();
+    sample(Phase, std::max(currentRSS(), max > LastMaxRSS ? max : 0), heapInUse());
+    max = std::max(max, LastMaxRSS);
+    char buf[160];
+    os << "===" << std::string(73, '-') << "===\n"
+       << std::string(30, ' ') << "Memory report\n"
+       << "===" << std::string(73, '-') << "===\n";
+
+    snprintf(buf, sizeof(buf), "  %-12s %12s %12s\n", "phase", "peak RSS", "heap in use");
+    os << buf;
+    for (auto &p : PhaseOrder) {
+        snprintf(buf, sizeof(buf), "  %-12s %12s %12s\n", p.c_str(), Size(PeakRSS[p]).c_str(),
+                 Size(PeakHeap[p]).c_str());
+        os << buf;
+    }
+    for (auto &p : PeakRSS)
+        max = std::max(max, p.second);
+    snprintf(buf, sizeof(buf), "  %-12s %12s\n", "overall", Size(max).c_str());
+    os << buf;
+
+    uint64_t nodes = 0, bytes = 0;
+    std::map<std::string, ClassMemory> byName;
+    for (auto &c : Classes) {
+        ClassMemory &n = byName[ClassName(c.first)];
+        n.Nodes += c.second.Nodes;
+        n.Bytes += c.second.Bytes;
+        nodes += c.second.Nodes;
+        bytes += c.second.Bytes;
+    }
+    os << "\nAST, allocated over the run (peak live " << Size(PeakLiveAST) << "):\n";
+    snprintf(buf, sizeof(buf), "  %-22s %10s %12s\n", "class", "nodes", "bytes");
+    os << buf;
+    for (auto &c : byName) {
+        snprintf(buf, sizeof(buf), "  %-22s %10llu %12s\n", c.first.c_str(),
+                 (unsigned long long)c.second.Nodes, Size(c.second.Bytes).c_str());
+        os << buf;
+    }
+    snprintf(buf, sizeof(buf), "  %-22s %10llu %12s\n", "total",
+             (unsigned long long)nodes, Size(bytes).c_str());
+    os << buf;
+    os << "Token strings: " << Size(TokenStrings)
+       << " on the heap (short names are stored inside their node)\n";
+
+    os << "\nSymbol tables, peak: " << PeakSymbols << " entries in " << PeakScopes
+       << " scopes, about " << Size(PeakSymbolBytes) << "\n";
+
+    size_t irBytes = 0, blocks = 0, insts = 0;
+    for (auto &f : Functions) {
+        irBytes += f.Bytes;
+        blocks += f.BasicBlocks;
+        insts += f.Instructions;
+    }
+    os << "\nLLVM IR: " << Functions.size() << " functions, " << blocks << " basic blocks, "
+       << insts << " instructions, " << Size(irBytes);
+    if (insts)
+        os << " (" << irBytes / insts << " B per instruction)";
+    os << "\n";
+
+    std::vector<FunctionMemory> largest(Functions);
+    size_t shown = std::min<size_t>(largest.size(), 10);
+    std::partial_sort(largest.begin(), largest.begin() + shown, largest.end(),
+        [](const FunctionMemory &a, const FunctionMemory &b) { return a.Bytes > b.Bytes; });
+    if (shown) {
+        snprintf(buf, sizeof(buf), "  %-30s %8s %12s %12s\n", "largest functions", "blocks",
+                 "instructions", "bytes");
+        os << buf;
+    }
+    for (size_t i = 0; i < shown; i++) {
+        snprintf(buf, sizeof(buf), "  %-30s %8u %12u %12s\n",
+                 largest[i].Name.c_str(), largest[i].BasicBlocks, largest[i].Instructions,
+                 Size(largest[i].Bytes).c_str());
+        os << buf;
+    }
+}
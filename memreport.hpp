@@ -0,0 +1,101 @@
+#ifndef __MEMREPORT_HPP__
+#define __MEMREPORT_HPP__ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <typeindex>
+#include <vector>
+
+namespace llvm { class AllocaInst; }
+class ExprAST;
+class FunctionAST;
+class PrototypeAST;
+
+typedef std::map<std::string, llvm::AllocaInst*> SymbolTable;
+
+struct ClassMemory {
+    uint64_t Nodes;
+    uint64_t Bytes;
+};
+
+struct FunctionMemory {
+    std::string Name;
+    size_t Bytes;
+    unsigned BasicBlocks;
+    unsigned Instructions;
+};
+
+/* Byte accounting for --mem-report. AST and string sizes are what malloc
+   actually handed out for each block (malloc_usable_size), IR sizes are
+   the growth of the operator new heap while a function is generated and
+   optimised, and RSS and heap in use are sampled whenever the pipeline
+   moves to another phase. Memory LLVM takes straight from malloc, such as
+   grown SmallVectors, is only visible in the RSS. Nothing is recorded
+   unless Enabled is set. */
+class MemReport {
+public:
+    MemReport()
+        : Enabled(false), Phase("startup"), LastMaxRSS(0), LiveAST(0), PeakLiveAST(0),
+          TokenStrings(0), PeakSymbols(0), PeakScopes(0), PeakSymbolBytes(0)
+    {}
+    static size_t heapBytes(const void *p);
+    static size_t stringBytes(const std::string &s);
+    template<class T>
+    static size_t vectorBytes(const std::vector<T> &v) {
+        return v.capacity() ? heapBytes(v.data()) : 0;
+    }
+    static size_t heapInUse();
+    static size_t currentRSS();
+
+    //walk a tree that has just been parsed, returns the bytes it holds
+    size_t addFunction(const FunctionAST *f);
+    size_t addPrototype(const PrototypeAST *p);
+    //the tree holding bytes has been deleted
+    void release(size_t bytes) { LiveAST -= bytes; }
+    void symbolTables(const SymbolTable &inner, const std::vector<SymbolTable> &outer);
+    //switches to another phase and returns the one that was current,
+    //does nothing unless Enabled
+    const char *enter(const char *phase);
+    void print(std::ostream &os);
+
+    bool Enabled;
+    std::vector<FunctionMemory> Functions;
+private:
+    void addNode(std::type_index t, size_t bytes);
+    size_t walkPrototype(const PrototypeAST *p);
+    void sample(const char *phase, size_t rss, size_t heap);
+    const char *Phase;
+    size_t LastMaxRSS;
+    std::vector<std::string> PhaseOrder;
+    std::map<std::string, size_t> PeakRSS;
+    std::map<std::string, size_t> PeakHeap;
+    std::map<std::type_index, ClassMemory> Classes;
+    size_t LiveAST;
+    size_t PeakLiveAST;
+    uint64_t TokenStrings;
+    size_t PeakSymbols;
+    size_t PeakScopes;
+    size_t PeakSymbolBytes;
+};
+
+extern MemReport TheMemReport;
+
+/* Attributes memory to a phase until the end of the scope, for phases
+   nested in another one, like codegen inside a serial parse. */
+class MemPhase {
+public:
+    MemPhase(const char *phase)
+        : Prev(TheMemReport.Enabled ? TheMemReport.enter(phase) : nullptr)
+    {}
+    ~MemPhase() {
+        if (Prev)
+            TheMemReport.enter(Prev);
+    }
+private:
+    const char *Prev;
+};
+
+#endif
@@ -0,0 +1,27 @@
+#include "switchpass.hpp"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+/* The switch lowering as a pass plugin:
+
+     opt -load-pass-plugin ./swi2else-plugin.so -passes=switch-to-ifelse
+     clang -fpass-plugin=./swi2else-plugin.so
+
+   In a default pipeline, as under clang, it also runs last, after
+   SimplifyCFG, so nothing folds the chains back into switches. */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return { LLVM_PLUGIN_API_VERSION, "swi2else", "1.0", [](PassBuilder &PB) {
+        PB.registerPipelineParsingCallback([](StringRef Name, FunctionPassManager &FPM,
+                                              ArrayRef<PassBuilder::PipelineElement>) {
+            if (Name != "switch-to-ifelse")
+                return false;
+            FPM.addPass(SwitchToIfElsePass());
+            return true;
+        });
+        PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, auto) {
+            MPM.addPass(createModuleToFunctionPassAdaptor(SwitchToIfElsePass()));
+        });
+    } };
+}
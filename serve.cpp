@@ -0,0 +1,250 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "serve.hpp"
+#include "llvm/Support/raw_ostream.h"
+
+//a worker that could not accept exits with this, the server waits a
+//little before forking the next one instead of spinning
+static const int AcceptFailed = 3;
+
+//fields are bounded before anything is allocated for them
+static const uint32_t MaxField = 1u << 30;
+
+static volatile sig_atomic_t Stopping = 0;
+
+static void Stop(int) {
+    Stopping = 1;
+}
+
+static bool ReadAll(int fd, char *p, size_t n) {
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+//MSG_NOSIGNAL: a client that went away must not kill the worker
+static bool WriteAll(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void PutLength(unsigned char *p, uint32_t n) {
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+static bool ReadField(int fd, std::string &s) {
+    unsigned char len[4];
+    if (!ReadAll(fd, (char*)len, 4))
+        return false;
+    uint32_t n = (uint32_t)len[0] << 24 | (uint32_t)len[1] << 16 | (uint32_t)len[2] << 8 | len[3];
+    if (n > MaxField)
+        return false;
+    s.resize(n);
+    return n == 0 || ReadAll(fd, &s[0], n);
+}
+
+static bool WriteFrame(int fd, char kind, const char *p, uint32_t n) {
+    unsigned char head[5];
+    head[0] = kind;
+    PutLength(head + 1, n);
+    return WriteAll(fd, (const char*)head, 5) && WriteAll(fd, p, n);
+}
+
+//the connection a worker answers, and the thread streaming its output
+static int Conn = -1;
+static std::thread Forwarder;
+static bool Finished = false;
+
+//copies stdout and stderr, redirected to pipes, into 'o' and 'e' frames
+//as they are written; keeps draining after a failed send so the
+//translation never blocks on a full pipe
+static void Forward(int out, int err) {
+    struct pollfd fds[2] = { { out, POLLIN, 0 }, { err, POLLIN, 0 } };
+    const char kinds[2] = { 'o', 'e' };
+    static char buf[1 << 16];
+    int open = 2;
+    while (open) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open--;
+                continue;
+            }
+            WriteFrame(Conn, kinds[i], buf, n);
+        }
+    }
+}
+
+static void Finish(int Status) {
+    if (Finished)
+        return;
+    Finished = true;
+    std::cout.flush();
+    std::cerr.flush();
+    llvm::outs().flush();
+    llvm::errs().flush();
+    fflush(stdout);
+    fflush(stderr);
+    //the pipes reach end of file once nothing holds their write ends
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    dup2(null, 2);
+    close(null);
+    Forwarder.join();
+    unsigned char s[4];
+    PutLength(s, Status);
+    WriteFrame(Conn, 's', (const char*)s, 4);
+    close(Conn);
+}
+
+//errors end the process through exit(), the reply still goes out
+static void FinishOnExit() {
+    Finish(EXIT_FAILURE);
+}
+
+static void Worker(int Listen, ServeHandler Handle) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    int c;
+    while ((c = accept(Listen, nullptr, nullptr)) < 0)
+        if (errno != EINTR && errno != ECONNABORTED)
+            _exit(AcceptFailed);
+    close(Listen);
+
+    std::string Options, Source;
+    if (!ReadField(c, Options) || !ReadField(c, Source))
+        _exit(EXIT_FAILURE);
+
+    int out[2], err[2];
+    if (pipe(out) < 0 || pipe(err) < 0)
+        _exit(EXIT_FAILURE);
+    //constructed now, so they are still alive when FinishOnExit runs
+    llvm::outs();
+    llvm::errs();
+    dup2(out[1], 1);
+    dup2(err[1], 2);
+    close(out[1]);
+    close(err[1]);
+    Conn = c;
+    Forwarder = std::thread(Forward, out[0], err[0]);
+    atexit(FinishOnExit);
+
+    Finish(Handle(Options, Source));
+    _exit(0);
+}
+
+int Serve(const std::string &Path, unsigned Workers, ServeHandler Handle) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << Path << std::endl;
+        return EXIT_FAILURE;
+    }
+    memcpy(addr.sun_path, Path.c_str(), Path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    //left behind by a server that did not shut down cleanly
+    struct stat st;
+    if (lstat(Path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(Path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(Path.c_str());
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    //no SA_RESTART, so a signal wakes the server from waitpid
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = Stop;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::set<pid_t> Live;
+    auto Spawn = [&]() {
+        pid_t p = fork();
+        if (p == 0)
+            Worker(fd, Handle);
+        if (p < 0)
+            perror("fork");
+        else
+            Live.insert(p);
+    };
+    for (unsigned i = 0; i < Workers; i++)
+        Spawn();
+    std::cerr << "Serving on " << Path << " with " << Workers << " workers" << std::endl;
+
+    //every worker answers one request, a fresh one takes its place
+    while (!Stopping) {
+        int status;
+        pid_t p = waitpid(-1, &status, 0);
+        if (p < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        Live.erase(p);
+        if (Stopping)
+            break;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == AcceptFailed)
+            sleep(1);
+        Spawn();
+    }
+
+    for (pid_t p : Live)
+        kill(p, SIGTERM);
+    while (waitpid(-1, nullptr, 0) > 0)
+        ;
+    close(fd);
+    unlink(Path.c_str());
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __SERVE_HPP__
+#define __SERVE_HPP__ 1
+
+#include <string>
+
+/* --serve: a long-lived process answering translation requests on a Unix
+   domain socket.
+
+   A request is two fields, each a 4-byte big-endian length followed by
+   that many bytes: the options, as on the command line and separated by
+   spaces ("--emit=c -O2"), then the source. The reply is a stream of
+   frames, a kind byte and a 4-byte big-endian length, then the payload:
+   'o' output (LLVM IR or C), 'e' diagnostics (errors, --stats=json), and
+   last 's' with the exit status as a 4-byte big-endian integer. Output
+   and diagnostics are sent as they are written.
+
+   The server initialises LLVM, the host target and the pass pipelines
+   once, then keeps Workers processes forked from that warm state waiting
+   on the socket. Each one answers a single request and exits, and the
+   server forks a new one in its place, so an error in one input, which
+   ends the process, never takes down the server or leaks into the next
+   request. */
+
+//runs one request, output on stdout and diagnostics on stderr, returns
+//the exit status
+typedef int (*ServeHandler)(const std::string &Options, const std::string &Source);
+
+//returns only when interrupted by SIGINT or SIGTERM, or if the socket
+//cannot be set up
+int Serve(const std::string &Path, unsigned Workers, ServeHandler Handle);
+
+#endif
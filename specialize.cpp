@@ -0,0 +1,301 @@
+#include <algorithm>
+#include "specialize.hpp"
+#include "stats.hpp"
+
+/* --specialize: the nodes' cloneNode and childSlots, the dispatcher
+   search and the folding of the copies. Trees are copied and walked from
+   explicit stacks, as for codegen and deletion. */
+
+extern LLVMContext TheContext;
+
+Specializer *TheSpecializer = nullptr;
+
+ExprAST *VariableExprAST::cloneNode() const { return new VariableExprAST(Name); }
+ExprAST *IntNumberExprAST::cloneNode() const { return new IntNumberExprAST(Val); }
+ExprAST *DoubleNumberExprAST::cloneNode() const { return new DoubleNumberExprAST(Val); }
+ExprAST *BlockAST::cloneNode() const { return new BlockAST(Vec); }
+ExprAST *AddExprAST::cloneNode() const { return new AddExprAST(Vec[0], Vec[1]); }
+ExprAST *SubExprAST::cloneNode() const { return new SubExprAST(Vec[0], Vec[1]); }
+ExprAST *MulExprAST::cloneNode() const { return new MulExprAST(Vec[0], Vec[1]); }
+ExprAST *DivExprAST::cloneNode() const { return new DivExprAST(Vec[0], Vec[1]); }
+ExprAST *LtExprAST::cloneNode() const { return new LtExprAST(Vec[0], Vec[1]); }
+ExprAST *GtExprAST::cloneNode() const { return new GtExprAST(Vec[0], Vec[1]); }
+ExprAST *EqExprAST::cloneNode() const { return new EqExprAST(Vec[0], Vec[1]); }
+ExprAST *NeExprAST::cloneNode() const { return new NeExprAST(Vec[0], Vec[1]); }
+ExprAST *LeExprAST::cloneNode() const { return new LeExprAST(Vec[0], Vec[1]); }
+ExprAST *GeExprAST::cloneNode() const { return new GeExprAST(Vec[0], Vec[1]); }
+ExprAST *CallExprAST::cloneNode() const { return new CallExprAST(Callee, Vec); }
+ExprAST *WhileExprAST::cloneNode() const { return new WhileExprAST(Vec[0], Vec[1]); }
+ExprAST *ForExprAST::cloneNode() const { return new ForExprAST(Vec[0], Vec[1], Vec[2], Vec[3]); }
+ExprAST *IfExprAST::cloneNode() const { return new IfExprAST(Vec[0], Vec[1], Vec[2]); }
+ExprAST *AssignExprAST::cloneNode() const { return new AssignExprAST(VarName, Vec[0]); }
+ExprAST *DeclExprAST::cloneNode() const { return new DeclExprAST(Types, Vec); }
+
+ExprAST *SwitchExprAST::cloneNode() const {
+    auto c = Cases;
+    return new SwitchExprAST(Condition, c);
+}
+
+ExprAST *DeclAndAssignExprAST::cloneNode() const {
+    return new DeclAndAssignExprAST(VarType, VarName, Expr);
+}
+
+void InnerExprAST::childSlots(vector<ExprAST**> &out) {
+    for (auto &i : Vec)
+        if (i != nullptr)
+            out.push_back(&i);
+}
+
+void SwitchExprAST::childSlots(vector<ExprAST**> &out) {
+    out.push_back(&Condition);
+    for (auto &c : Cases) {
+        if (c.first.first != nullptr)
+            out.push_back(&c.first.first);
+        if (c.first.second != nullptr)
+            out.push_back(&c.first.second);
+    }
+}
+
+//each copied node points at the original's children until its slots
+//are copied in turn
+ExprAST *CloneTree(const ExprAST *E) {
+    ExprAST *Root = E->cloneNode();
+    Root->setLoc(E->Line, E->Col);
+    vector<ExprAST**> Slots;
+    Root->childSlots(Slots);
+    while (!Slots.empty()) {
+        ExprAST **s = Slots.back();
+        Slots.pop_back();
+        const ExprAST *Orig = *s;
+        *s = Orig->cloneNode();
+        (*s)->setLoc(Orig->Line, Orig->Col);
+        (*s)->childSlots(Slots);
+    }
+    return Root;
+}
+
+static PrototypeAST *CloneProto(const PrototypeAST *P, const std::string &Name) {
+    std::vector<TypeAST*> Args;
+    for (size_t i = 0; i < P->arg_size(); i++)
+        Args.push_back(new TypeAST(P->getArgType(i), P->getArgName(i)));
+    PrototypeAST *C = new PrototypeAST(P->getType(), Name, Args);
+    C->setLoc(P->Line, P->Col);
+    return C;
+}
+
+static size_t CountNodes(const ExprAST *E) {
+    size_t n = 0;
+    std::vector<const ExprAST*> work(1, E);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        n++;
+        e->children(work);
+    }
+    return n;
+}
+
+/* The bodies S runs when its selector is V: from the first case
+   labelled V, or else the default, up to and including the first one
+   ending in break. Nullptr when it runs none. A switch codegen would
+   reject, with several defaults, is left alone. */
+static bool Foldable(const SwitchExprAST *S) {
+    int Defaults = 0;
+    for (auto &c : S->getCases()) {
+        if (c.first.first == nullptr)
+            Defaults++;
+        else if (dynamic_cast<const IntNumberExprAST*>(c.first.first) == nullptr)
+            return false;
+    }
+    return Defaults <= 1;
+}
+
+static ExprAST *Fold(SwitchExprAST *S, int V) {
+    auto &Cases = S->getCases();
+    size_t Start = Cases.size();
+    for (size_t i = 0; i < Cases.size() && Start == Cases.size(); i++)
+        if (Cases[i].first.first != nullptr && static_cast<IntNumberExprAST*>(Cases[i].first.first)->getVal() == V)
+            Start = i;
+    for (size_t i = 0; i < Cases.size() && Start == Cases.size(); i++)
+        if (Cases[i].first.first == nullptr)
+            Start = i;
+
+    std::vector<ExprAST*> Run;
+    for (size_t i = Start; i < Cases.size(); i++) {
+        Run.push_back(S->takeBody(i));
+        if (Cases[i].second)
+            break;
+    }
+    if (Run.empty())
+        return nullptr;
+    if (Run.size() == 1)
+        return Run[0];
+    //each body keeps its own scope, as in the switch
+    BlockAST *B = new BlockAST(Run);
+    B->setLoc(S->Line, S->Col);
+    return B;
+}
+
+Specializer::~Specializer() {
+    for (auto &d : Dispatchers)
+        delete d.second.Func;
+}
+
+FunctionAST *Specializer::specialize(const Dispatcher &D, const std::map<size_t, int> &Values,
+                                     const std::string &Name) {
+    const PrototypeAST *P = D.Func->getProto();
+    std::map<std::string, int> Bound;
+    for (auto &v : Values)
+        Bound[P->getArgName(v.first)] = v.second;
+
+    ExprAST *Body = CloneTree(D.Func->getBody());
+    //a switch only ever is a statement of a block
+    std::vector<ExprAST*> Work(1, Body);
+    vector<ExprAST**> Slots;
+    while (!Work.empty()) {
+        ExprAST *e = Work.back();
+        Work.pop_back();
+        if (BlockAST *B = dynamic_cast<BlockAST*>(e)) {
+            vector<ExprAST*> &V = B->statements();
+            for (size_t i = 0; i < V.size(); ) {
+                SwitchExprAST *S = dynamic_cast<SwitchExprAST*>(V[i]);
+                auto *Sel = S ? dynamic_cast<const VariableExprAST*>(S->getCondition()) : nullptr;
+                auto It = Sel ? Bound.find(Sel->getName()) : Bound.end();
+                if (It == Bound.end() || !Foldable(S)) {
+                    i++;
+                    continue;
+                }
+                bool Last = i + 1 == V.size();
+                ExprAST *R = Fold(S, It->second);
+                delete S;
+                if (R != nullptr)
+                    V[i++] = R;
+                else
+                    V.erase(V.begin() + i);
+                //the switch's value, 0, where it was the function's or
+                //the block would be left empty
+                if (Last && (B == Body || V.empty()))
+                    V.push_back(new IntNumberExprAST(0));
+            }
+        }
+        e->childSlots(Slots);
+        for (auto s : Slots)
+            Work.push_back(*s);
+        Slots.clear();
+    }
+    return new FunctionAST(CloneProto(P, Name), Body);
+}
+
+void Specializer::remember(const FunctionAST *F) {
+    const PrototypeAST *P = F->getProto();
+    //a repeated argument name means the first
+    std::map<std::string, size_t> Ints;
+    for (size_t i = 0; i < P->arg_size(); i++)
+        if (P->getArgType(i) == Type::getInt32Ty(TheContext))
+            Ints.insert({ P->getArgName(i), i });
+    if (Ints.empty())
+        return;
+
+    //any assignment or declaration of the name, even one shadowing it,
+    //keeps the argument from being treated as a constant
+    std::set<std::string> Written, Switched;
+    std::vector<const ExprAST*> work;
+    F->children(work);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        if (auto *a = dynamic_cast<const AssignExprAST*>(e))
+            Written.insert(a->getName());
+        else if (auto *d = dynamic_cast<const DeclAndAssignExprAST*>(e))
+            Written.insert(d->getName());
+        else if (auto *d = dynamic_cast<const DeclExprAST*>(e))
+            Written.insert(d->getNames().begin(), d->getNames().end());
+        else if (auto *s = dynamic_cast<const SwitchExprAST*>(e))
+            if (auto *v = dynamic_cast<const VariableExprAST*>(s->getCondition()))
+                Switched.insert(v->getName());
+        e->children(work);
+    }
+
+    Dispatcher D;
+    for (auto &a : Ints)
+        if (Switched.count(a.first) && !Written.count(a.first))
+            D.Params.push_back(a.second);
+    if (D.Params.empty())
+        return;
+    std::sort(D.Params.begin(), D.Params.end());
+    D.Func = new FunctionAST(CloneProto(P, P->getName()), CloneTree(F->getBody()));
+    //a redefinition, codegen reports it
+    auto It = Dispatchers.find(P->getName());
+    if (It != Dispatchers.end())
+        delete It->second.Func;
+    Dispatchers[P->getName()] = D;
+}
+
+std::vector<FunctionAST*> Specializer::function(FunctionAST *F) {
+    PhaseTimer t("specialize");
+    std::vector<FunctionAST*> New;
+
+    std::vector<ExprAST*> Work(1, F->getBody());
+    vector<ExprAST**> Slots;
+    while (!Work.empty()) {
+        ExprAST *e = Work.back();
+        Work.pop_back();
+        e->childSlots(Slots);
+        for (auto s : Slots)
+            Work.push_back(*s);
+        Slots.clear();
+
+        CallExprAST *C = dynamic_cast<CallExprAST*>(e);
+        auto It = C ? Dispatchers.find(C->getCallee()) : Dispatchers.end();
+        if (It == Dispatchers.end())
+            continue;
+        const Dispatcher &D = It->second;
+        const vector<ExprAST*> &Args = C->getArgs();
+        if (Args.size() != D.Func->getProto()->arg_size())
+            continue;
+        std::map<size_t, int> Values;
+        for (size_t p : D.Params)
+            if (auto *n = dynamic_cast<const IntNumberExprAST*>(Args[p]))
+                Values[p] = n->getVal();
+        if (Values.empty())
+            continue;
+
+        auto Key = std::make_pair(C->getCallee(), Values);
+        auto Copy = Copies.find(Key);
+        if (Copy == Copies.end()) {
+            //handler(3) calls _handler__3, an argument left free is x.
+            //Identifiers in the input start with a letter, so only
+            //another copy can have the name
+            std::string Name = "_" + C->getCallee() + "_";
+            for (size_t p : D.Params)
+                Name += "_" + (Values.count(p) ? to_string((unsigned)Values[p]) : string("x"));
+            while (Names.count(Name))
+                Name += "_";
+            FunctionAST *S = specialize(D, Values, Name);
+            size_t Nodes = CountNodes(S->getBody());
+            if (Used + Nodes > Budget) {
+                //over budget, the call keeps the generic version
+                delete S;
+                Copy = Copies.insert({ Key, "" }).first;
+            }
+            else {
+                Used += Nodes;
+                Names.insert(Name);
+                New.push_back(S);
+                Copy = Copies.insert({ Key, Name }).first;
+                if (TheStats.Enabled) {
+                    TheStats.Specializations++;
+                    TheStats.SpecializedNodes += Nodes;
+                }
+            }
+        }
+        if (Copy->second.empty())
+            continue;
+        C->setCallee(Copy->second);
+        if (TheStats.Enabled)
+            TheStats.SpecializedCalls++;
+    }
+
+    remember(F);
+    return New;
+}
@@ -0,0 +1,55 @@
+#ifndef __SPECIALIZE_HPP__
+#define __SPECIALIZE_HPP__ 1
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ast.hpp"
+
+/* --specialize: a function that switches on one of its int arguments,
+   never assigning or redeclaring it, is a dispatcher. A call passing a
+   literal for that argument is redirected to a copy of the dispatcher
+   named after the value, _handler__3 for handler(3), in which every
+   switch on the argument is replaced by the bodies it would run for that
+   value: the matching case up to its break, or the default, or nothing. The copy keeps the
+   signature, so only the callee's name changes at the call.
+
+   Works on the AST before any backend sees it, so IR, C and bytecode
+   output all get the copies. Callees are declared before their callers,
+   so each copy is handed on just before the first function calling it.
+   Budget caps the AST nodes all copies may add. */
+class Specializer {
+public:
+    Specializer(size_t budget) : Budget(budget), Used(0) {}
+    ~Specializer();
+    //redirects F's calls, returns the copies they need, which must be
+    //handled before F, and remembers F if it is a dispatcher
+    std::vector<FunctionAST*> function(FunctionAST *F);
+private:
+    struct Dispatcher {
+        //a copy, the original is deleted once it has been handled
+        FunctionAST *Func;
+        //the int arguments switched on
+        std::vector<size_t> Params;
+    };
+    void remember(const FunctionAST *F);
+    //the copy of D for Values, an argument index to its literal
+    FunctionAST *specialize(const Dispatcher &D, const std::map<size_t, int> &Values,
+                            const std::string &Name);
+    size_t Budget;
+    size_t Used;
+    std::map<std::string, Dispatcher> Dispatchers;
+    //the name of each copy made, by dispatcher and bound values
+    std::map<std::pair<std::string, std::map<size_t, int>>, std::string> Copies;
+    //the copies' names, which two dispatchers could otherwise share
+    std::set<std::string> Names;
+};
+
+//set while --specialize is on
+extern Specializer *TheSpecializer;
+
+//a copy of E's whole tree
+ExprAST *CloneTree(const ExprAST *E);
+
+#endif
@@ -0,0 +1,109 @@
+#include <cxxabi.h>
+#include <cstdlib>
+#include <ostream>
+#include <iomanip>
+#include "ast.hpp"
+#include "stats.hpp"
+#include "llvm/Support/Timer.h"
+
+Stats TheStats;
+
+void Stats::countNodes(const FunctionAST *f) {
+    Nodes[typeid(FunctionAST)]++;
+    Nodes[typeid(PrototypeAST)]++;
+    std::vector<const ExprAST*> work;
+    f->children(work);
+    while (!work.empty()) {
+        const ExprAST *e = work.back();
+        work.pop_back();
+        Nodes[typeid(*e)]++;
+        e->children(work);
+    }
+}
+
+std::string ClassName(std::type_index t) {
+    int status;
+    char *name = abi::__cxa_demangle(t.name(), nullptr, nullptr, &status);
+    std::string s = status == 0 ? name : t.name();
+    free(name);
+    return s;
+}
+
+//names in this tool are C identifiers, nothing to escape
+static std::ostream &Key(std::ostream &os, const std::string &k) {
+    return os << "\"" << k << "\": ";
+}
+
+void Stats::print(std::ostream &os) const {
+    os << std::setprecision(9) << "{\n  ";
+    Key(os, "phases") << "{";
+    const char *sep = "";
+    for (auto &p : Phases) {
+        os << sep << "\n    ";
+        Key(os, p.first) << p.second;
+        sep = ",";
+    }
+    os << "\n  },\n  ";
+
+    Key(os, "counters") << "{\n    ";
+    Key(os, "tokens") << Tokens << ",\n    ";
+    Key(os, "symbol_lookups") << SymbolLookups << ",\n    ";
+    Key(os, "symbol_scope_probes") << ScopeProbes << ",\n    ";
+    Key(os, "functions_emitted") << FunctionsEmitted << ",\n    ";
+    Key(os, "functions_skipped") << FunctionsSkipped << ",\n    ";
+    Key(os, "specializations") << Specializations << ",\n    ";
+    Key(os, "specialized_calls") << SpecializedCalls << ",\n    ";
+    Key(os, "specialized_nodes") << SpecializedNodes << "\n  },\n  ";
+
+    Key(os, "ast_nodes") << "{";
+    std::map<std::string, uint64_t> byName;
+    for (auto &n : Nodes)
+        byName[ClassName(n.first)] += n.second;
+    sep = "";
+    for (auto &n : byName) {
+        os << sep << "\n    ";
+        Key(os, n.first) << n.second;
+        sep = ",";
+    }
+    os << "\n  },\n  ";
+
+    Key(os, "functions") << "[";
+    sep = "";
+    for (auto &f : Functions) {
+        os << sep << "\n    {";
+        Key(os, "name") << "\"" << f.Name << "\", ";
+        Key(os, "codegen") << f.Codegen << ", ";
+        Key(os, "verify") << f.Verify << ", ";
+        Key(os, "optimize") << f.Optimize << ", ";
+        Key(os, "basic_blocks") << f.BasicBlocks << ", ";
+        Key(os, "instructions") << f.Instructions << "}";
+        sep = ",";
+    }
+    os << "\n  ],\n  ";
+
+    Key(os, "switches") << "[";
+    sep = "";
+    for (auto &s : Switches) {
+        os << sep << "\n    {";
+        Key(os, "function") << "\"" << s.Function << "\", ";
+        Key(os, "cases") << s.Cases << ", ";
+        Key(os, "basic_blocks") << s.BasicBlocks << ", ";
+        Key(os, "compares") << s.Compares << "}";
+        sep = ",";
+    }
+    os << "\n  ],\n  ";
+
+    //per-pass times of the legacy pass manager (-time-passes timers)
+    Key(os, "passes") << "{";
+    std::string passes;
+    raw_string_ostream ps(passes);
+    TimerGroup::printAllJSONValues(ps, "\n    ");
+    ps.flush();
+    //LLVM prefixes each entry with a tab, reindent to match the rest
+    size_t at = 0;
+    while ((at = passes.find("\n\t", at)) != std::string::npos)
+        passes.replace(at + 1, 1, "    ");
+    if (passes.compare(0, 5, "\n    ") == 0 && passes.size() > 5 && passes[5] == '\t')
+        passes.erase(5, 1);
+    os << passes << "\n  }\n}\n";
+}
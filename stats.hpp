@@ -0,0 +1,82 @@
+#ifndef __STATS_HPP__
+#define __STATS_HPP__ 1
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <typeindex>
+#include <vector>
+#include <cstdint>
+
+class ExprAST;
+class FunctionAST;
+
+struct FunctionStats {
+    std::string Name;
+    double Codegen;
+    double Verify;
+    double Optimize;
+    unsigned BasicBlocks;
+    unsigned Instructions;
+};
+
+struct SwitchStats {
+    std::string Function;
+    unsigned Cases;
+    unsigned BasicBlocks;
+    unsigned Compares;
+};
+
+/* Timers and counters reported by --stats=json. Nothing is recorded unless
+   Enabled is set, the instrumented paths only test that flag. Times are in
+   seconds. */
+class Stats {
+public:
+    Stats()
+        : Enabled(false), Tokens(0), SymbolLookups(0), ScopeProbes(0), FunctionsEmitted(0), FunctionsSkipped(0),
+          Specializations(0), SpecializedCalls(0), SpecializedNodes(0)
+    {}
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    void countNodes(const FunctionAST *f);
+    void print(std::ostream &os) const;
+
+    bool Enabled;
+    uint64_t Tokens;
+    uint64_t SymbolLookups;
+    uint64_t ScopeProbes;
+    //function bodies handed to the backend, and those --entry left out
+    uint64_t FunctionsEmitted;
+    uint64_t FunctionsSkipped;
+    //--specialize: copies made, calls redirected to them and their nodes
+    uint64_t Specializations;
+    uint64_t SpecializedCalls;
+    uint64_t SpecializedNodes;
+    std::map<std::string, double> Phases;
+    std::map<std::type_index, uint64_t> Nodes;
+    std::vector<FunctionStats> Functions;
+    std::vector<SwitchStats> Switches;
+};
+
+extern Stats TheStats;
+
+//demangled name of an AST class
+std::string ClassName(std::type_index t);
+
+/* Adds the time until the end of the scope to a phase. */
+class PhaseTimer {
+public:
+    PhaseTimer(const char *phase)
+        : Phase(phase), Start(TheStats.Enabled ? Stats::now() : 0)
+    {}
+    ~PhaseTimer() {
+        if (TheStats.Enabled)
+            TheStats.Phases[Phase] += Stats::now() - Start;
+    }
+private:
+    const char *Phase;
+    double Start;
+};
+
+#endif
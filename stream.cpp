@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <vector>
+#include "stream.hpp"
+#include "stats.hpp"
+#include "memreport.hpp"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+extern Module* TheModule;
+void yyerror(std::string s);
+
+IRStreamer *TheStreamer = nullptr;
+
+//the nodes reachable from Work, each once, in the order the printer
+//numbers them
+static void CollectMetadata(std::vector<const MDNode*> Work, std::vector<const MDNode*> &Nodes) {
+    //popped from the back, the first root is numbered first
+    std::reverse(Work.begin(), Work.end());
+    SmallPtrSet<const MDNode*, 8> Seen;
+    while (!Work.empty()) {
+        const MDNode *N = Work.back();
+        Work.pop_back();
+        //printed inline where they are used
+        if (isa<DIExpression>(N) || !Seen.insert(N).second)
+            continue;
+        Nodes.push_back(N);
+        for (unsigned i = N->getNumOperands(); i > 0; i--)
+            if (auto *Op = dyn_cast_or_null<MDNode>(N->getOperand(i - 1)))
+                Work.push_back(Op);
+    }
+}
+
+//nodes attached to F and its instructions
+static void FunctionMetadata(const Function *F, std::vector<const MDNode*> &Nodes) {
+    SmallVector<std::pair<unsigned, MDNode*>, 4> MDs;
+    std::vector<const MDNode*> Roots;
+    F->getAllMetadata(MDs);
+    for (auto &MD : MDs)
+        Roots.push_back(MD.second);
+    for (auto &B : *F)
+        for (auto &I : B) {
+            MDs.clear();
+            I.getAllMetadata(MDs);
+            for (auto &MD : MDs)
+                Roots.push_back(MD.second);
+        }
+    CollectMetadata(Roots, Nodes);
+}
+
+//the number MST gave N
+static unsigned Slot(const MDNode *N, ModuleSlotTracker &MST) {
+    std::string Text;
+    raw_string_ostream S(Text);
+    N->printAsOperand(S, MST);
+    S.flush();
+    return atoi(Text.c_str() + 1);
+}
+
+//copies Text with every "!N" outside quotes replaced by "!Map[N]"
+static void Renumber(const std::string &Text, const DenseMap<unsigned, unsigned> &Map, raw_ostream &OS) {
+    size_t i = 0;
+    while (i < Text.size()) {
+        size_t j = Text.find_first_of("!\"", i);
+        if (j == std::string::npos) {
+            OS << StringRef(Text).substr(i);
+            return;
+        }
+        if (Text[j] == '"') {
+            size_t e = Text.find('"', j + 1);
+            e = e == std::string::npos ? Text.size() : e + 1;
+            OS << StringRef(Text).slice(i, e);
+            i = e;
+            continue;
+        }
+        OS << StringRef(Text).slice(i, j + 1);
+        i = j + 1;
+        if (i == Text.size() || !isdigit(Text[i]))
+            continue;
+        unsigned N = 0;
+        for (; i < Text.size() && isdigit(Text[i]); i++)
+            N = N * 10 + (Text[i] - '0');
+        auto It = Map.find(N);
+        OS << (It != Map.end() ? It->second : N);
+    }
+}
+
+void IRStreamer::number(const std::vector<const MDNode*> &Nodes, ModuleSlotTracker &MST,
+                        DenseMap<unsigned, unsigned> &Map, raw_ostream &Defs) {
+    for (const MDNode *N : Nodes) {
+        unsigned Local = Slot(N, MST);
+        auto It = Numbers.find(N);
+        if (It != Numbers.end()) {
+            Map[Local] = It->second;
+            continue;
+        }
+        Map[Local] = NextMetadata;
+        //distinct nodes (subprograms, blocks, loop ids) and locations
+        //belong to one function, the compile unit is the exception
+        if ((N->isUniqued() && !isa<DILocation>(N)) || isa<DICompileUnit>(N))
+            Numbers[N] = NextMetadata;
+        NextMetadata++;
+        N->print(Defs, MST, TheModule);
+        Defs << "\n";
+    }
+}
+
+IRStreamer::IRStreamer(raw_ostream &os) : OS(os), NextMetadata(0) {}
+
+IRStreamer::~IRStreamer() {
+    for (auto &P : Printed)
+        delete P.second;
+}
+
+void IRStreamer::begin() {
+    //numbers each function's metadata as it is taken in, rather than
+    //the whole module's up front
+    MST.reset(new ModuleSlotTracker(TheModule, false));
+    TheModule->print(OS, nullptr);
+}
+
+void IRStreamer::define(const std::string &Name) const {
+    if (Printed.count(Name))
+        yyerror("Function redefinition is not allowed " + Name);
+}
+
+void IRStreamer::function(Function *F) {
+    PhaseTimer t("print");
+    MemPhase m("print");
+    std::string Text, Defs;
+    raw_string_ostream S(Text), D(Defs);
+    S << "\n";
+    //Function::print hides the overload that takes a slot tracker; it
+    //takes F into the tracker and purges its local slots afterwards
+    F->Value::print(S, *MST);
+    S.flush();
+
+    std::vector<const MDNode*> Nodes;
+    DenseMap<unsigned, unsigned> Map;
+    FunctionMetadata(F, Nodes);
+    number(Nodes, *MST, Map, D);
+    D.flush();
+    Renumber(Text, Map, OS);
+    if (!Defs.empty()) {
+        OS << "\n";
+        Renumber(Defs, Map, OS);
+    }
+
+    F->deleteBody();
+    F->removeFromParent();
+    Printed[F->getName().str()] = F;
+    for (Function *B : Borrowed)
+        B->removeFromParent();
+    Borrowed.clear();
+}
+
+Function *IRStreamer::declaration(const std::string &Name) {
+    auto It = Printed.find(Name);
+    if (It == Printed.end())
+        return nullptr;
+    Function *F = It->second;
+    if (F->getParent() == nullptr) {
+        TheModule->getFunctionList().push_back(F);
+        Borrowed.push_back(F);
+    }
+    return F;
+}
+
+void IRStreamer::end() {
+    PhaseTimer t("print");
+    MemPhase m("print");
+    for (auto &F : *TheModule) {
+        if (!F.isDeclaration() || Printed.count(F.getName().str()))
+            continue;
+        //the attribute groups are never printed; intrinsics get theirs
+        //back from the intrinsic tables when the output is read
+        F.setAttributes(AttributeList());
+        OS << "\n";
+        F.print(OS);
+    }
+
+    //named metadata: -g's compile unit and module flags
+    //named metadata is only numbered when a tracker starts, and most
+    //of it was added after the stream's
+    ModuleSlotTracker Final(TheModule);
+    std::vector<const MDNode*> Roots, Nodes;
+    for (auto &NMD : TheModule->named_metadata())
+        for (const MDNode *N : NMD.operands())
+            Roots.push_back(N);
+    if (!Roots.empty()) {
+        std::string Text, Defs;
+        raw_string_ostream S(Text), D(Defs);
+        for (auto &NMD : TheModule->named_metadata())
+            NMD.print(S, Final);
+        S.flush();
+        DenseMap<unsigned, unsigned> Map;
+        CollectMetadata(Roots, Nodes);
+        number(Nodes, Final, Map, D);
+        D.flush();
+        OS << "\n";
+        Renumber(Text, Map, OS);
+        if (!Defs.empty()) {
+            OS << "\n";
+            Renumber(Defs, Map, OS);
+        }
+    }
+    OS.flush();
+}
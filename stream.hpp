@@ -0,0 +1,61 @@
+#ifndef __STREAM_HPP__
+#define __STREAM_HPP__ 1
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/DenseMap.h"
+
+namespace llvm { class Function; class MDNode; class ModuleSlotTracker; class raw_ostream; }
+
+/* --stream: every function is printed as soon as it has been generated
+   and optimised, then its body is deleted, so the module only keeps
+   declarations for later calls to resolve against. Memory then follows
+   the largest function instead of the whole input, and output starts
+   while the file is still being parsed.
+
+   The pieces concatenate to the module TheModule->print would have
+   printed: the header first, each definition followed by the metadata
+   nodes it is the first to use, and at the end the declarations that
+   were never defined and the named metadata. The printer's numbers
+   follow its own order, so they are mapped onto the stream's;
+   nodes several functions share, such as -g's compile unit and types,
+   keep the number they were first printed with.
+
+   Printing a function walks the module it is in, so a printed function
+   leaves the module and a later call borrows its declaration back until
+   the caller has been printed. With one slot tracker for the whole
+   stream, a function costs the same however many came before it. */
+class IRStreamer {
+public:
+    IRStreamer(llvm::raw_ostream &os);
+    ~IRStreamer();
+    //module id, source file name, data layout and triple
+    void begin();
+    //stops with the usual error if Name was already printed, its body is
+    //gone so the module can no longer tell
+    void define(const std::string &Name) const;
+    void function(llvm::Function *F);
+    //a printed function's declaration, back in the module for a call,
+    //nullptr if Name was never printed
+    llvm::Function *declaration(const std::string &Name);
+    void end();
+private:
+    //maps the numbers MST gave Nodes to stream numbers, printing the
+    //definitions of the nodes not printed before into Defs
+    void number(const std::vector<const llvm::MDNode*> &Nodes, llvm::ModuleSlotTracker &MST,
+                llvm::DenseMap<unsigned, unsigned> &Map, llvm::raw_ostream &Defs);
+    llvm::raw_ostream &OS;
+    std::unique_ptr<llvm::ModuleSlotTracker> MST;
+    unsigned NextMetadata;
+    //the printed functions, out of the module
+    std::map<std::string, llvm::Function*> Printed;
+    std::vector<llvm::Function*> Borrowed;
+    llvm::DenseMap<const llvm::MDNode*, unsigned> Numbers;
+};
+
+//set while --stream is on
+extern IRStreamer *TheStreamer;
+
+#endif
@@ -0,0 +1,138 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "switchpass.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+using namespace llvm;
+
+//the switch's branch weights, default first, empty without profile data
+static std::vector<uint64_t> Weights(const SwitchInst *SI) {
+    std::vector<uint64_t> W;
+    MDNode *Prof = SI->getMetadata(LLVMContext::MD_prof);
+    if (!Prof || Prof->getNumOperands() != SI->getNumSuccessors() + 1)
+        return W;
+    auto *Kind = dyn_cast<MDString>(Prof->getOperand(0));
+    if (!Kind || Kind->getString() != "branch_weights")
+        return W;
+    for (unsigned i = 1; i < Prof->getNumOperands(); i++) {
+        auto *C = mdconst::dyn_extract<ConstantInt>(Prof->getOperand(i));
+        if (!C)
+            return std::vector<uint64_t>();
+        W.push_back(C->getZExtValue());
+    }
+    return W;
+}
+
+//branch weights are 32 bits, both sides are scaled down together
+static MDNode *BranchWeights(LLVMContext &C, uint64_t Taken, uint64_t NotTaken) {
+    while (Taken > UINT32_MAX || NotTaken > UINT32_MAX) {
+        Taken >>= 1;
+        NotTaken >>= 1;
+    }
+    return MDBuilder(C).createBranchWeights(Taken, NotTaken);
+}
+
+static void LowerSwitch(SwitchInst *SI) {
+    BasicBlock *Orig = SI->getParent();
+    Function *F = Orig->getParent();
+    LLVMContext &C = F->getContext();
+    Value *Cond = SI->getCondition();
+    BasicBlock *Default = SI->getDefaultDest();
+    bool DefaultReachable = !isa<UnreachableInst>(Default->getFirstNonPHIOrDbg());
+    std::vector<std::pair<ConstantInt*, BasicBlock*>> Cases;
+    for (auto Case : SI->cases())
+        Cases.push_back({ Case.getCaseValue(), Case.getCaseSuccessor() });
+
+    //W[0] is the default, W[i + 1] case i; Rest is what the compares
+    //still ahead can reach
+    std::vector<uint64_t> W = Weights(SI);
+    uint64_t Rest = 0;
+    for (size_t i = 0; i < W.size(); i++)
+        if (i > 0 || DefaultReachable)
+            Rest += W[i];
+
+    IRBuilder<> B(C);
+    B.SetCurrentDebugLocation(SI->getDebugLoc());
+    SI->eraseFromParent();
+    if (!DefaultReachable && !Cases.empty())
+        Default->removePredecessor(Orig, true);
+
+    //the blocks now branching to each successor, once per edge, in place
+    //of Orig in its phis
+    DenseMap<BasicBlock*, SmallVector<BasicBlock*, 2>> Edges;
+    B.SetInsertPoint(Orig);
+    BasicBlock *After = Orig;
+    //an unreachable default leaves the last case nothing to be told
+    //apart from, so the compare before it misses straight into it
+    size_t Compares = Cases.size();
+    if (!DefaultReachable && Compares > 0)
+        Compares--;
+    BasicBlock *Final = DefaultReachable || Cases.empty() ? Default : Cases.back().second;
+    for (size_t i = 0; i < Compares; i++) {
+        bool Last = i + 1 == Compares;
+        BasicBlock *Miss = Last ? Final : BasicBlock::Create(C, "else", F, After->getNextNode());
+        Value *IfCondV = B.CreateICmpEQ(Cond, Cases[i].first, "ifcond");
+        BranchInst *Br = B.CreateCondBr(IfCondV, Cases[i].second, Miss);
+        if (!W.empty()) {
+            Rest -= W[i + 1];
+            Br->setMetadata(LLVMContext::MD_prof, BranchWeights(C, W[i + 1], Rest));
+        }
+        Edges[Cases[i].second].push_back(B.GetInsertBlock());
+        if (Last) {
+            Edges[Final].push_back(B.GetInsertBlock());
+        }
+        else {
+            After = Miss;
+            B.SetInsertPoint(Miss);
+        }
+    }
+    //nothing to compare: the default of a switch without cases, or the
+    //only case when the default is unreachable
+    if (Compares == 0) {
+        BasicBlock *Only = Cases.empty() ? Default : Cases[0].second;
+        B.CreateBr(Only);
+        Edges[Only].push_back(B.GetInsertBlock());
+    }
+
+    for (auto &E : Edges) {
+        for (PHINode &P : E.first->phis()) {
+            SmallVector<unsigned, 2> Slots;
+            for (unsigned k = 0; k < P.getNumIncomingValues(); k++)
+                if (P.getIncomingBlock(k) == Orig)
+                    Slots.push_back(k);
+            if (Slots.empty())
+                continue;
+            Value *V = P.getIncomingValue(Slots[0]);
+            for (size_t j = 0; j < E.second.size(); j++) {
+                if (j < Slots.size())
+                    P.setIncomingBlock(Slots[j], E.second[j]);
+                else
+                    P.addIncoming(V, E.second[j]);
+            }
+        }
+    }
+
+    if (!DefaultReachable && pred_empty(Default))
+        DeleteDeadBlock(Default);
+}
+
+bool LowerSwitches(Function &F) {
+    std::vector<SwitchInst*> Switches;
+    for (auto &B : F)
+        if (auto *SI = dyn_cast_or_null<SwitchInst>(B.getTerminator()))
+            Switches.push_back(SI);
+    for (SwitchInst *SI : Switches)
+        LowerSwitch(SI);
+    return !Switches.empty();
+}
+
+PreservedAnalyses SwitchToIfElsePass::run(Function &F, FunctionAnalysisManager &) {
+    return LowerSwitches(F) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
@@ -0,0 +1,24 @@
+#ifndef __SWITCHPASS_HPP__
+#define __SWITCHPASS_HPP__ 1
+
+#include "llvm/IR/PassManager.h"
+
+/* Lowers every SwitchInst of a function to the if/else chain
+   SwitchExprAST::codegen builds: one equality compare per case, in case
+   order, the last miss going to the default. Works on any IR, so it backs
+   swi2else --ir and the opt plugin as well.
+
+   Branch weights on the switch are carried over, each compare getting its
+   case's weight against the sum of everything after it. A default that is
+   unreachable (clang's fully covered switches) saves the last compare.
+   The pass is linear in the number of cases, and functions without a
+   switch are left untouched, with their analyses preserved. */
+class SwitchToIfElsePass : public llvm::PassInfoMixin<SwitchToIfElsePass> {
+public:
+    llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &AM);
+};
+
+//true if F had a switch
+bool LowerSwitches(llvm::Function &F);
+
+#endif
@@ -0,0 +1,19 @@
+int f(int x) {
+    int r = 0;
+    switch (x) {
+        case 1: r = 10; break;
+        case 2: r = 20; break;
+        default: r = 99;
+    }
+    r;
+}
+int g(int x) {
+    int r = 0;
+    switch (x) {
+        case 1: r = r + 1;
+        default: r = r + 100;
+        case 3: r = r + 3; break;
+        case 4: r = r + 4;
+    }
+    r;
+}
@@ -0,0 +1,31 @@
+int sum(int n) {
+    int s = 0;
+    int i;
+    for (i = 0; i < n; i = i + 1) {
+        switch (i) {
+            case 1:
+                s = s + 10;
+                break;
+            case 2:
+                s = s + 20;
+            default:
+                s = s + 1;
+        }
+    }
+    s;
+}
+
+int count() {
+    int c = 0;
+    for (int j = 0; j < 100; j = j + 1) {
+        c = c + j;
+    }
+    c;
+}
+
+int forever(int x) {
+    for (;;) {
+        x = x + 1;
+    }
+    x;
+}
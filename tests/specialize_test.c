@@ -0,0 +1,25 @@
+//--specialize: handler(1), (2), (3) and (7) get copies with the switch
+//folded, handler(a) keeps the generic one; handler__2 is the user's own
+int handler(int op, int x) {
+    int r = x;
+    switch (op) {
+        case 1: r = r + 1; break;
+        case 2: r = r * 2;
+        case 3: r = r + 3; break;
+        default: r = 0 - 1;
+    }
+    r;
+}
+
+int func() {
+    int a = handler(1, 10);
+    int b = handler(2, 10);
+    int c = handler(3, 10);
+    int d = handler(7, 10);
+    int e = handler(a, 10);
+    a + b + c + d + e;
+}
+
+int handler__2(int z) {
+    z + handler(2, z);
+}
@@ -0,0 +1,43 @@
+//--run regression: the VM must keep codegen's rules, ints divide and
+//compare unsigned and an int condition holds when it is 0.
+//./swi2else --run tests/vm_test.c prints 63
+int pick(int x) {
+    int r = 0;
+    switch (x) {
+        case 1: r = 1;
+        case 2: r = r + 2; break;
+        default: r = 4;
+    }
+    r;
+}
+
+int main() {
+    int r = 0;
+    int m = 0 - 7;
+    if (m / 2 == 2147483644) {
+        r = r + 1;
+    }
+    if (m > 5) {
+        r = r + 2;
+    }
+    int z = 0;
+    if (z) {
+        r = r + 4;
+    }
+    int one = 1;
+    if (one) {
+        r = 0 - 100;
+    }
+    int n = 0;
+    while (n) {
+        n = 1;
+        r = r + 8;
+    }
+    if (pick(1) == 3) {
+        r = r + 16;
+    }
+    if (pick(9) == 4) {
+        r = r + 32;
+    }
+    r;
+}
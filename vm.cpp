@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include "bytecode.hpp"
+
+/* The bytecode interpreter and the --emit=bytecode listing. Dispatch is
+   threaded through a table of label addresses where the compiler has
+   computed goto (GCC, clang), each handler jumping straight to the next
+   one, and a switch in a loop elsewhere. Calls keep their frames on a
+   heap stack, so recursion depth is not limited by the C++ stack. */
+
+void yyerror(string s);
+
+extern LLVMContext TheContext;
+
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#endif
+
+static const char *const OpName[OpCount] = {
+#define VM_NAME(Name, Operands) #Name,
+    VM_OPCODES(VM_NAME)
+#undef VM_NAME
+};
+
+//deeper recursion is an error instead of running out of memory
+static const size_t MaxCallDepth = 1 << 24;
+
+//the constants go into the top registers of each frame
+static inline void LoadConstants(const VMFunction *Fn, VMSlot *R) {
+    std::copy(Fn->Constants.begin(), Fn->Constants.end(), R + Fn->Registers - Fn->Constants.size());
+}
+
+struct CallRecord {
+    const VMFunction *Fn;
+    const uint32_t *Return;
+    unsigned Result;
+};
+
+static VMSlot Execute(const std::vector<VMFunction> &Functions, const VMFunction *Fn) {
+    std::vector<VMSlot> Stack(std::max(4096u, Fn->Registers));
+    std::vector<CallRecord> Calls;
+    VMSlot *R = Stack.data();
+    const uint32_t *Code = Fn->Code.data();
+    const uint32_t *pc = Code;
+    LoadConstants(Fn, R);
+
+#ifdef VM_THREADED
+    static void *const Labels[OpCount] = {
+#define VM_LABEL(Name, Operands) &&Do##Name,
+        VM_OPCODES(VM_LABEL)
+#undef VM_LABEL
+    };
+#define CASE(Name) Do##Name:
+#define DISPATCH() goto *Labels[*pc]
+    DISPATCH();
+#else
+#define CASE(Name) case Op##Name:
+#define DISPATCH() goto Dispatch
+Dispatch:
+    switch (*pc) {
+#endif
+
+#define NEXT(Name) pc += OpLength[Op##Name]; DISPATCH()
+#define INT_OP(Name, Expr) \
+    CASE(Name) { \
+        uint32_t a = R[pc[2]].I, b = R[pc[3]].I; \
+        R[pc[1]].I = (int32_t)(Expr); \
+        NEXT(Name); \
+    }
+#define DOUBLE_OP(Name, Expr) \
+    CASE(Name) { \
+        double a = R[pc[2]].D, b = R[pc[3]].D; \
+        R[pc[1]].D = (Expr); \
+        NEXT(Name); \
+    }
+#define INT_JUMP(Name, Expr) \
+    CASE(Name) { \
+        uint32_t a = R[pc[1]].I, b = R[pc[2]].I; \
+        pc = (Expr) ? pc + OpLength[Op##Name] : Code + pc[3]; \
+        DISPATCH(); \
+    }
+#define DOUBLE_JUMP(Name, Expr) \
+    CASE(Name) { \
+        double a = R[pc[1]].D, b = R[pc[2]].D; \
+        pc = (Expr) ? pc + OpLength[Op##Name] : Code + pc[3]; \
+        DISPATCH(); \
+    }
+
+    CASE(Move) {
+        R[pc[1]] = R[pc[2]];
+        NEXT(Move);
+    }
+    //ints wrap as in the IR, division and compares are unsigned
+    INT_OP(AddInt, a + b)
+    INT_OP(SubInt, a - b)
+    INT_OP(MulInt, a * b)
+    CASE(DivInt) {
+        uint32_t b = R[pc[3]].I;
+        if (b == 0)
+            yyerror("Division by zero");
+        R[pc[1]].I = (int32_t)((uint32_t)R[pc[2]].I / b);
+        NEXT(DivInt);
+    }
+    DOUBLE_OP(AddDouble, a + b)
+    DOUBLE_OP(SubDouble, a - b)
+    DOUBLE_OP(MulDouble, a * b)
+    DOUBLE_OP(DivDouble, a / b)
+    //double compares are unordered, true when either side is NaN
+    CASE(LtInt) { R[pc[1]].D = (uint32_t)R[pc[2]].I < (uint32_t)R[pc[3]].I; NEXT(LtInt); }
+    CASE(GtInt) { R[pc[1]].D = (uint32_t)R[pc[2]].I > (uint32_t)R[pc[3]].I; NEXT(GtInt); }
+    CASE(LeInt) { R[pc[1]].D = (uint32_t)R[pc[2]].I <= (uint32_t)R[pc[3]].I; NEXT(LeInt); }
+    CASE(GeInt) { R[pc[1]].D = (uint32_t)R[pc[2]].I >= (uint32_t)R[pc[3]].I; NEXT(GeInt); }
+    CASE(EqInt) { R[pc[1]].D = R[pc[2]].I == R[pc[3]].I; NEXT(EqInt); }
+    CASE(NeInt) { R[pc[1]].D = R[pc[2]].I != R[pc[3]].I; NEXT(NeInt); }
+    DOUBLE_OP(LtDouble, !(a >= b))
+    DOUBLE_OP(GtDouble, !(a <= b))
+    DOUBLE_OP(LeDouble, !(a > b))
+    DOUBLE_OP(GeDouble, !(a < b))
+    DOUBLE_OP(EqDouble, !(a < b) && !(a > b))
+    DOUBLE_OP(NeDouble, !(a == b))
+    INT_JUMP(JumpUnlessLtInt, a < b)
+    INT_JUMP(JumpUnlessGtInt, a > b)
+    INT_JUMP(JumpUnlessLeInt, a <= b)
+    INT_JUMP(JumpUnlessGeInt, a >= b)
+    INT_JUMP(JumpUnlessEqInt, a == b)
+    INT_JUMP(JumpUnlessNeInt, a != b)
+    DOUBLE_JUMP(JumpUnlessLtDouble, !(a >= b))
+    DOUBLE_JUMP(JumpUnlessGtDouble, !(a <= b))
+    DOUBLE_JUMP(JumpUnlessLeDouble, !(a > b))
+    DOUBLE_JUMP(JumpUnlessGeDouble, !(a < b))
+    DOUBLE_JUMP(JumpUnlessEqDouble, !(a < b) && !(a > b))
+    DOUBLE_JUMP(JumpUnlessNeDouble, !(a == b))
+    CASE(Jump) {
+        pc = Code + pc[1];
+        DISPATCH();
+    }
+    CASE(JumpIfIntNonZero) {
+        pc = R[pc[1]].I != 0 ? Code + pc[2] : pc + OpLength[OpJumpIfIntNonZero];
+        DISPATCH();
+    }
+    //the then branch needs an ordered non-zero value
+    CASE(JumpIfDoubleFalse) {
+        double c = R[pc[1]].D;
+        pc = c < 0 || c > 0 ? pc + OpLength[OpJumpIfDoubleFalse] : Code + pc[2];
+        DISPATCH();
+    }
+    CASE(SwitchDense) {
+        const SwitchTable &T = Fn->Tables[pc[2]];
+        uint32_t i = (uint32_t)R[pc[1]].I - (uint32_t)T.Min;
+        pc = Code + (i < T.Targets.size() ? T.Targets[i] : T.Default);
+        DISPATCH();
+    }
+    CASE(SwitchSorted) {
+        const SwitchTable &T = Fn->Tables[pc[2]];
+        int32_t Sel = R[pc[1]].I;
+        auto k = std::lower_bound(T.Keys.begin(), T.Keys.end(), Sel);
+        pc = Code + (k != T.Keys.end() && *k == Sel ? T.Targets[k - T.Keys.begin()] : T.Default);
+        DISPATCH();
+    }
+    //the callee's registers follow the caller's, arguments and constants
+    //copied in
+    CASE(Call) {
+        const VMFunction *Callee = &Functions[pc[2]];
+        if (!Callee->Defined)
+            yyerror("Function " + Callee->Name + " has no body");
+        if (Calls.size() == MaxCallDepth)
+            yyerror("Call stack overflow in " + Callee->Name);
+        size_t Base = (R - Stack.data()) + Fn->Registers;
+        if (Base + Callee->Registers > Stack.size()) {
+            Stack.resize(std::max(2 * Stack.size(), Base + Callee->Registers));
+            R = Stack.data() + Base - Fn->Registers;
+        }
+        VMSlot *Args = R + pc[3];
+        R = Stack.data() + Base;
+        for (uint32_t i = 0; i < pc[4]; i++)
+            R[i] = Args[i];
+        LoadConstants(Callee, R);
+        Calls.push_back({ Fn, pc + OpLength[OpCall], pc[1] });
+        Fn = Callee;
+        Code = pc = Fn->Code.data();
+        DISPATCH();
+    }
+    CASE(Return) {
+        VMSlot V = R[pc[1]];
+        if (Calls.empty())
+            return V;
+        CallRecord &C = Calls.back();
+        Fn = C.Fn;
+        R -= Fn->Registers;
+        R[C.Result] = V;
+        Code = Fn->Code.data();
+        pc = C.Return;
+        Calls.pop_back();
+        DISPATCH();
+    }
+    CASE(ReturnVoid) {
+        if (Calls.empty())
+            return VMSlot();
+        CallRecord &C = Calls.back();
+        Fn = C.Fn;
+        R -= Fn->Registers;
+        Code = Fn->Code.data();
+        pc = C.Return;
+        Calls.pop_back();
+        DISPATCH();
+    }
+
+#ifndef VM_THREADED
+    }
+    return VMSlot();
+#endif
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef INT_OP
+#undef DOUBLE_OP
+#undef INT_JUMP
+#undef DOUBLE_JUMP
+}
+
+void VMProgram::run(const std::string &Name, std::ostream &os) const {
+    int i = find(Name);
+    if (i < 0)
+        yyerror("Function " + Name + " does not exist");
+    const VMFunction &Fn = Functions[i];
+    if (!Fn.Params.empty())
+        yyerror("Function " + Name + " must be called with " + to_string(Fn.Params.size()) + " arguments");
+    if (!Fn.Defined)
+        yyerror("Function " + Name + " has no body");
+    VMSlot V = Execute(Functions, &Fn);
+    if (Fn.Ret == Type::getInt32Ty(TheContext))
+        os << V.I << "\n";
+    else if (Fn.Ret == Type::getDoubleTy(TheContext))
+        os << std::setprecision(17) << V.D << "\n";
+}
+
+void VMProgram::print(std::ostream &os) const {
+    for (auto &Fn : Functions) {
+        os << CTypeName(Fn.Ret) << " " << Fn.Name << "(";
+        for (size_t i = 0; i < Fn.Params.size(); i++)
+            os << (i ? ", " : "") << CTypeName(Fn.Params[i]) << " r" << i;
+        os << ")";
+        if (!Fn.Defined) {
+            os << ";\n\n";
+            continue;
+        }
+        os << ", " << Fn.Registers << " registers\n";
+        size_t First = Fn.Registers - Fn.Constants.size();
+        for (size_t i = 0; i < Fn.Constants.size(); i++) {
+            os << "  r" << First + i << " = ";
+            if (Fn.ConstantTypes[i] == Type::getDoubleTy(TheContext))
+                os << std::setprecision(17) << Fn.Constants[i].D << "\n";
+            else
+                os << Fn.Constants[i].I << "\n";
+        }
+        for (size_t pc = 0; pc < Fn.Code.size(); pc += OpLength[Fn.Code[pc]]) {
+            unsigned Op = Fn.Code[pc];
+            os << std::setw(6) << pc << "  " << OpName[Op];
+            const uint32_t *o = &Fn.Code[pc + 1];
+            for (const char *k = OpOperands[Op]; *k; k++, o++) {
+                os << (k == OpOperands[Op] ? " " : ", ");
+                switch (*k) {
+                case 'r': os << "r" << *o; break;
+                case 't': os << "@" << *o; break;
+                case 's': os << "table " << *o; break;
+                case 'f': os << Functions[*o].Name; break;
+                default: os << *o; break;
+                }
+            }
+            os << "\n";
+        }
+        for (size_t t = 0; t < Fn.Tables.size(); t++) {
+            const SwitchTable &T = Fn.Tables[t];
+            os << "  table " << t << (T.Dense ? ", dense from " : ", sorted") ;
+            if (T.Dense)
+                os << T.Min;
+            os << ":";
+            for (size_t i = 0; i < T.Targets.size(); i++) {
+                if (T.Dense && T.Targets[i] == T.Default)
+                    continue;
+                os << " " << (T.Dense ? T.Min + (int64_t)i : T.Keys[i]) << " @" << T.Targets[i];
+            }
+            os << ", default @" << T.Default << "\n";
+        }
+        os << "\n";
+    }
+}